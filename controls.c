@@ -10,69 +10,58 @@
 #include "display.h"
 #include "eventqueue.h"
 #include "controls.h"
+#include "settings.h"
+#include "profile.h"
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <inttypes.h>
 
 enum usr_input_events {
     UNKNOWN_INPUT,
-    VOLTAGE_LEFT,
-    VOLTAGE_RIGHT,
-    CURRENT_LEFT,
-    CURRENT_RIGHT,
-    VOLTAGE_BTN,
-    CURRENT_BTN,
     TOP_BTN
 };
 
-void set_and_save_voltage(int8_t diff) {
-    set_voltage(*get_voltage() + diff);
+void set_and_save_voltage(int16_t diff) {
+    int32_t new_voltage = (int32_t)*get_voltage() + diff;
+    set_voltage(new_voltage > 0 ? new_voltage : 0);
     set_dynamic_readout(get_voltage());
-    evq_timed_push(save_eeprom_voltage, 0, 3000);
+    evq_timed_push(save_settings, LED_VOLTAGE, 3000, EVQ_BACKGROUND);
 }
 
+/* notches is signed sum of detents turned since the last call,
+ * positive is clockwise
+ */
 #define VOLTAGE_CHANGE_PER_NOTCH 5
-void voltage_knob_handler(uint16_t usr_input) {
+void voltage_knob_handler(uint16_t notches) {
     status_led_on(LED_VOLTAGE);
     status_led_off(LED_CURRENT);
-    switch(usr_input) {
-        case VOLTAGE_LEFT:
-            set_and_save_voltage(-VOLTAGE_CHANGE_PER_NOTCH);
-            break;
-
-        case VOLTAGE_RIGHT:
-            set_and_save_voltage(VOLTAGE_CHANGE_PER_NOTCH);
-            break;
-
-        case VOLTAGE_BTN:
-            set_dynamic_readout(get_voltage());
-            break;
-    }
+    set_and_save_voltage((int16_t)notches * VOLTAGE_CHANGE_PER_NOTCH);
+}
+
+void voltage_button_handler(uint16_t null) {
+    status_led_on(LED_VOLTAGE);
+    status_led_off(LED_CURRENT);
+    set_dynamic_readout(get_voltage());
 }
 
-void set_and_save_current(int8_t diff) {
-    set_current_limit(*get_current_limit() + diff);
+void set_and_save_current(int16_t diff) {
+    int32_t new_limit = (int32_t)*get_current_limit() + diff;
+    set_current_limit(new_limit > 0 ? new_limit : 0);
     set_dynamic_readout(get_current_limit());
-    evq_timed_push(save_eeprom_current_limit, 0, 3000);
+    evq_timed_push(save_settings, LED_CURRENT, 3000, EVQ_BACKGROUND);
 }
 
 #define CURRENT_CHANGE_PER_NOTCH 10
-void current_knob_handler(uint16_t usr_input) {
+void current_knob_handler(uint16_t notches) {
     status_led_on(LED_CURRENT);
     status_led_off(LED_VOLTAGE);
-    switch(usr_input) {
-    case CURRENT_LEFT:
-        set_and_save_current(-CURRENT_CHANGE_PER_NOTCH);
-        break;
-
-    case CURRENT_RIGHT:
-        set_and_save_current(CURRENT_CHANGE_PER_NOTCH);
-        break;
-
-    case CURRENT_BTN:
-        set_dynamic_readout(get_current());
-        break;
-    }
+    set_and_save_current((int16_t)notches * CURRENT_CHANGE_PER_NOTCH);
+}
+
+void current_button_handler(uint16_t null) {
+    status_led_on(LED_CURRENT);
+    status_led_off(LED_VOLTAGE);
+    set_dynamic_readout(get_current());
 }
 
 void button_handler(uint16_t usr_input) {
@@ -120,28 +109,78 @@ enum encoderid {
     ENC_VOLTAGE = 0b10
 };
 
-uint16_t encoder_direction(uint8_t id) {
+/* Knob acceleration
+ *
+ * A detent which comes less than ms milliseconds after the previous detent
+ * of the same knob and in the same direction counts as gain detents. Steps
+ * are ordered by ms and the first match wins, slower turns count as one.
+ */
+typedef struct {
+    uint8_t ms;
+    uint8_t gain;
+} accel_step;
+
+const accel_step accel_curve[] = {
+    { 8, 16 },
+    { 20, 6 },
+    { 50, 2 }
+};
+
+#define ACCEL_STEPS (sizeof(accel_curve) / sizeof(accel_curve[0]))
+
+/* Returns detent scaled with knob velocity */
+int8_t accelerate(uint8_t id, int8_t direction) {
+    static uint16_t last_time[2];
+    static int8_t last_direction[2];
+
+    uint8_t idx = id - ENC_CURRENT;
+    uint16_t now = evq_time();
+    uint16_t elapsed = now - last_time[idx];
+    last_time[idx] = now;
+
+    if(direction != last_direction[idx]) {
+        // reversing is always slow and filters out contact bounce
+        last_direction[idx] = direction;
+        return direction;
+    }
+
+    for(uint8_t step = 0; step < ACCEL_STEPS; step++) {
+        if(elapsed < accel_curve[step].ms) {
+            return direction * accel_curve[step].gain;
+        }
+    }
+    return direction;
+}
+
+/* Returns +1 for clockwise and -1 for counter-clockwise detent */
+int8_t encoder_direction(uint8_t id) {
     switch(id) {
     case ENC_CURRENT:
-        if(PIND & _BV(PIND6)) { return CURRENT_LEFT; }
-        else { return CURRENT_RIGHT; }
+        if(PIND & _BV(PIND6)) { return -1; }
+        else { return 1; }
 
     case ENC_VOLTAGE:
-        if(PINB & _BV(PINB6)) { return VOLTAGE_LEFT; }
-        else { return VOLTAGE_RIGHT; }
+        if(PINB & _BV(PINB6)) { return -1; }
+        else { return 1; }
     }
 
-    return UNKNOWN_INPUT;
+    return 0;
 }
 
+/* Detents are merged into a pending knob event, so a fast spin takes one
+ * queue slot instead of one per detent.
+ */
 ISR(PCINT0_vect) {
+    PROFILE_SCOPE(PROF_PCINT0);
     // ENC2 A
     if(PINB & _BV(PINB7)) {
-        evq_push(current_knob_handler, encoder_direction(ENC_CURRENT));
+        int8_t notches = accelerate(ENC_CURRENT, encoder_direction(ENC_CURRENT));
+        evq_push_merge(current_knob_handler, notches, EVQ_NORMAL);
     }
 }
 
 ISR(PCINT1_vect) {
+    PROFILE_SCOPE(PROF_PCINT1);
     status_led_toggle(LED_VOLTAGE);
     /*if(PINC & _BV(PINC4)) {
         status_led_off(LED_VOLTAGE);
@@ -151,6 +190,7 @@ ISR(PCINT1_vect) {
 }
 
 ISR(PCINT2_vect) {
+    PROFILE_SCOPE(PROF_PCINT2);
     // TODO: Cant react to VOLTAGE knob while switch is pressed
     static uint8_t wait_for_btn_release = 0;
 
@@ -162,24 +202,27 @@ ISR(PCINT2_vect) {
 
     // TACTILE SW PRESS
     if((PIND & _BV(PIND4)) == 0) {
-        evq_push(button_handler, TOP_BTN);
+        evq_push(button_handler, TOP_BTN, EVQ_NORMAL);
         wait_for_btn_release = 1;
         return;
     }
 
     // ENC1 A
     if(PIND & _BV(PIND5) ) {
-        evq_push(voltage_knob_handler, encoder_direction(ENC_VOLTAGE));
+        int8_t notches = accelerate(ENC_VOLTAGE, encoder_direction(ENC_VOLTAGE));
+        evq_push_merge(voltage_knob_handler, notches, EVQ_NORMAL);
     }
 
 }
 
 ISR(INT0_vect) {
-    evq_push(voltage_knob_handler, VOLTAGE_BTN);
+    PROFILE_SCOPE(PROF_INT0);
+    evq_push(voltage_button_handler, 0, EVQ_NORMAL);
 }
 
 ISR(INT1_vect) {
-    evq_push(current_knob_handler, CURRENT_BTN);
+    PROFILE_SCOPE(PROF_INT1);
+    evq_push(current_button_handler, 0, EVQ_NORMAL);
 }
 
 
@@ -13,7 +13,9 @@
 void init_controls(void);
 
 void voltage_knob_handler(uint16_t);
+void voltage_button_handler(uint16_t);
 void current_knob_handler(uint16_t);
+void current_button_handler(uint16_t);
 void button_handler(uint16_t);
 
 #endif /* CONTROLS_H_ */
@@ -8,122 +8,232 @@
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <inttypes.h>
 #include "display.h"
 #include "peripherals.h"
 #include "eventqueue.h"
+#include "profile.h"
 
 volatile uint8_t seq_nbr;
 volatile uint16_t* readout_p_;
 volatile uint16_t static_readout_;
 volatile char show_dots;
 
-uint16_t get_readout_segments(uint8_t);
+/* Render cache: segment words of both multiplex phases for frame_value_.
+ * Setters mark the frame dirty, the value behind readout_p_ is compared on
+ * every refresh.
+ */
+uint16_t frame_[2];
+uint16_t frame_value_;
+volatile uint8_t frame_dirty_ = 1;
+
+void render_frame(uint16_t value);
 void display_handler(uint16_t);
 
+/* Font ----------------------------------------------------------------------
+ *
+ * Glyphs are sets of the usual segments, wiring lists which shift register
+ * bit of which multiplex phase drives segments a - g of a digit position.
+ * Segment words of the font are generated from these at compile time.
+ *
+ *      a
+ *    f   b
+ *      g
+ *    e   c
+ *      d
+ */
+#define SEG_A 0x01
+#define SEG_B 0x02
+#define SEG_C 0x04
+#define SEG_D 0x08
+#define SEG_E 0x10
+#define SEG_F 0x20
+#define SEG_G 0x40
+
+#define GLYPH_0 (SEG_A | SEG_B | SEG_C | SEG_D | SEG_E | SEG_F)
+#define GLYPH_1 (SEG_B | SEG_C)
+#define GLYPH_2 (SEG_A | SEG_B | SEG_D | SEG_E | SEG_G)
+#define GLYPH_3 (SEG_A | SEG_B | SEG_C | SEG_D | SEG_G)
+#define GLYPH_4 (SEG_B | SEG_C | SEG_F | SEG_G)
+#define GLYPH_5 (SEG_A | SEG_C | SEG_D | SEG_F | SEG_G)
+#define GLYPH_6 (SEG_A | SEG_C | SEG_D | SEG_E | SEG_F | SEG_G)
+#define GLYPH_7 (SEG_A | SEG_B | SEG_C)
+#define GLYPH_8 (SEG_A | SEG_B | SEG_C | SEG_D | SEG_E | SEG_F | SEG_G)
+#define GLYPH_9 (SEG_A | SEG_B | SEG_C | SEG_D | SEG_F | SEG_G)
+#define GLYPH_A (SEG_A | SEG_B | SEG_C | SEG_E | SEG_F | SEG_G)
+#define GLYPH_C (SEG_A | SEG_D | SEG_E | SEG_F)
+#define GLYPH_c (SEG_D | SEG_E | SEG_G)
+#define GLYPH_E (SEG_A | SEG_D | SEG_E | SEG_F | SEG_G)
+#define GLYPH_L (SEG_D | SEG_E | SEG_F)
+#define GLYPH_O GLYPH_0
+#define GLYPH_r (SEG_E | SEG_G)
+#define GLYPH_u (SEG_C | SEG_D | SEG_E)
+#define GLYPH_U (SEG_B | SEG_C | SEG_D | SEG_E | SEG_F)
+#define GLYPH_BLANK 0
+
+/* Shift register bit of a phase, phases are the two 16-bit words */
+#define PIN(phase, bit) ((uint32_t)1 << ((phase) * 16 + (bit)))
+
+/* Segments a, b, c, d, e, f, g of each position. Thousands is a half digit
+ * for 1 and 2 only, its d, e and g share one line and f is missing.
+ */
+#define ONES_WIRING      PIN(0, 3),  PIN(0, 5),  PIN(0, 4),  PIN(1, 4), \
+                         PIN(1, 6),  PIN(1, 3),  PIN(1, 5)
+#define TENS_WIRING      PIN(1, 9),  PIN(1, 8),  PIN(1, 7),  PIN(0, 7), \
+                         PIN(0, 6),  PIN(0, 9),  PIN(0, 8)
+#define HUNDREDS_WIRING  PIN(0, 10), PIN(0, 12), PIN(0, 11), PIN(1, 11), \
+                         PIN(1, 13), PIN(1, 10), PIN(1, 12)
+#define THOUSANDS_WIRING PIN(0, 15), PIN(0, 14), PIN(0, 13), PIN(1, 15), \
+                         PIN(1, 15), 0,          PIN(1, 15)
+#define DOTS_PIN PIN(1, 2)
+
+#define WIRE(glyph, a, b, c, d, e, f, g)   \
+    (((glyph) & SEG_A ? (a) : 0) |         \
+     ((glyph) & SEG_B ? (b) : 0) |         \
+     ((glyph) & SEG_C ? (c) : 0) |         \
+     ((glyph) & SEG_D ? (d) : 0) |         \
+     ((glyph) & SEG_E ? (e) : 0) |         \
+     ((glyph) & SEG_F ? (f) : 0) |         \
+     ((glyph) & SEG_G ? (g) : 0))
+#define WIRE_(...) WIRE(__VA_ARGS__)
+
+#define ONES(glyph) WIRE_(glyph, ONES_WIRING)
+#define TENS(glyph) WIRE_(glyph, TENS_WIRING)
+#define HUNDREDS(glyph) WIRE_(glyph, HUNDREDS_WIRING)
+#define THOUSANDS(glyph) WIRE_(glyph, THOUSANDS_WIRING)
+
+/* Bit 0 and 1 enable the common of phase 0 and 1, set only if the phase
+ * lights something
+ */
+#define PHASE(pins, phase) ((uint16_t)((pins) >> ((phase) * 16)))
+#define WORDS(pins) {                                                    \
+    PHASE(pins, 0) ? PHASE(pins, 0) | _BV(0) : 0,                        \
+    PHASE(pins, 1) ? PHASE(pins, 1) | _BV(1) : 0 }
+
+#define DIGITS(position) \
+    WORDS(position(GLYPH_0)), WORDS(position(GLYPH_1)), \
+    WORDS(position(GLYPH_2)), WORDS(position(GLYPH_3)), \
+    WORDS(position(GLYPH_4)), WORDS(position(GLYPH_5)), \
+    WORDS(position(GLYPH_6)), WORDS(position(GLYPH_7)), \
+    WORDS(position(GLYPH_8)), WORDS(position(GLYPH_9))
+
 #define TENS_OFFSET 10
 #define HUNDRED_OFFSET 20
 #define THOUSAND_OFFSET 30
-#define OL 33
-#define DOTS 34
-#define CUR 35
-uint16_t display_data[36][2] = {
-    { 0b0000000000111001, 0b0000000001011010 }, // xxx0
-    { 0b0000000000110001, 0b0000000000000000 }, // xxx1
-    { 0b0000000000101001, 0b0000000001110010 }, // xxx2
-    { 0b0000000000111001, 0b0000000000110010 }, // xxx3
-    { 0b0000000000110001, 0b0000000000101010 }, // xxx4
-    { 0b0000000000011001, 0b0000000000111010 }, // xxx5
-    { 0b0000000000011001, 0b0000000001111010 }, // xxx6
-    { 0b0000000000111001, 0b0000000000000000 }, // xxx7
-    { 0b0000000000111001, 0b0000000001111010 }, // xxx8
-    { 0b0000000000111001, 0b0000000000111010 }, // xxx9
-    { 0b0000001011000001, 0b0000001110000010 }, // xx0x
-    { 0b0000000000000000, 0b0000000110000010 }, // xx1x
-    { 0b0000000111000001, 0b0000001100000010 }, // xx2x
-    { 0b0000000110000001, 0b0000001110000010 }, // xx3x
-    { 0b0000001100000001, 0b0000000110000010 }, // xx4x
-    { 0b0000001110000001, 0b0000001010000010 }, // xx5x
-    { 0b0000001111000001, 0b0000001010000010 }, // xx6x
-    { 0b0000000000000000, 0b0000001110000010 }, // xx7x
-    { 0b0000001111000001, 0b0000001110000010 }, // xx8x
-    { 0b0000001110000001, 0b0000001110000010 }, // xx9x
-    { 0b0001110000000001, 0b0010110000000010 }, // x0xx
-    { 0b0001100000000001, 0b0000000000000000 }, // x1xx
-    { 0b0001010000000001, 0b0011100000000010 }, // x2xx
-    { 0b0001110000000001, 0b0001100000000010 }, // x3xx
-    { 0b0001100000000001, 0b0001010000000010 }, // x4xx
-    { 0b0000110000000001, 0b0001110000000010 }, // x5xx
-    { 0b0000110000000001, 0b0011110000000010 }, // x6xx
-    { 0b0001110000000001, 0b0000000000000000 }, // x7xx
-    { 0b0001110000000001, 0b0011110000000010 }, // x8xx
-    { 0b0001110000000001, 0b0001110000000010 }, // x9xx
-    { 0b0000000000000000, 0b0000000000000000 }, // xxxx
-    { 0b0110000000000001, 0b0000000000000000 }, // 1xxx
-    { 0b1100000000000001, 0b1000000000000010 }, // 2xxx
-    { 0b0000001011000001, 0b0000001111011010 }, // OL
-    { 0b0000000000000000, 0b0000000000000110 }, // DOTS
-    { 0b0000000011000001, 0b0011100011100010 }, // cur
+#define DOTS 33
+#define STRINGS 34 // special_display values from DISPLAY_CUR on
+
+const uint16_t font_[][2] PROGMEM = {
+    DIGITS(ONES),
+    DIGITS(TENS),
+    DIGITS(HUNDREDS),
+    WORDS(THOUSANDS(GLYPH_BLANK)),
+    WORDS(THOUSANDS(GLYPH_1)),
+    WORDS(THOUSANDS(GLYPH_2)),
+    WORDS(DOTS_PIN),
+    WORDS(HUNDREDS(GLYPH_c) | TENS(GLYPH_u) | ONES(GLYPH_r)), // DISPLAY_CUR
+    WORDS(TENS(GLYPH_O) | ONES(GLYPH_L)),                     // DISPLAY_OL
+    WORDS(TENS(GLYPH_C) | ONES(GLYPH_C)),                     // DISPLAY_CC
+    WORDS(TENS(GLYPH_C) | ONES(GLYPH_U)),                     // DISPLAY_CV
+    WORDS(HUNDREDS(GLYPH_E) | TENS(GLYPH_r) | ONES(GLYPH_r)), // DISPLAY_ERR
+    WORDS(ONES(GLYPH_U)),                                     // DISPLAY_VOLTS
+    WORDS(ONES(GLYPH_A)),                                     // DISPLAY_AMPS
 };
 
+#define FONT_ROWS (sizeof(font_) / sizeof(font_[0]))
+
+uint16_t font_word(uint8_t row, uint8_t seq) {
+    return pgm_read_word(&font_[row][seq]);
+}
+
 void init_display(void) {
     init_spi();
-    DDRD |= _BV(PD0) + _BV(PD1); // LED_VOLTAGE, LED_CURRENT outputs
+    DDRD |= LED_VOLTAGE | LED_CURRENT; // outputs
 
     seq_nbr = 0;
     show_dots = 0;
 
     set_static_readout(0);
-    evq_push(display_handler, 0); // start display
+    evq_push(display_handler, 0, EVQ_NORMAL); // start display
 }
 
 void set_dynamic_readout(uint16_t* readout) {
     readout_p_ = readout;
+    frame_dirty_ = 1;
 }
 
 void set_static_readout(uint16_t readout) {
     static_readout_ = readout;
     readout_p_ = &static_readout_;
+    frame_dirty_ = 1;
 }
 
 void display_dots(void) {
     show_dots ^= 1;
+    frame_dirty_ = 1;
+}
+
+/* Double dabble, converts 0 - 9999 to packed BCD without divisions */
+uint16_t bin_to_bcd(uint16_t bin) {
+    uint16_t bcd = 0;
+    for(uint8_t bit = 0; bit < 16; bit++) {
+        // digits >= 5 would overflow 9 when shifted, add 3 to carry over
+        if((bcd & 0x000F) >= 0x0005) { bcd += 0x0003; }
+        if((bcd & 0x00F0) >= 0x0050) { bcd += 0x0030; }
+        if((bcd & 0x0F00) >= 0x0500) { bcd += 0x0300; }
+        if((bcd & 0xF000) >= 0x5000) { bcd += 0x3000; }
+        bcd = (bcd << 1) | (bin >> 15);
+        bin <<= 1;
+    }
+    return bcd;
 }
 
-uint16_t get_readout_segments(uint8_t seq) {
+void render_frame(uint16_t value) {
     /* Display can show numerical values between 0 - 2999 */
-    if (*readout_p_ < 3000 && *readout_p_ >= 0) {
-        uint16_t segments = 0;
-        int thousands = THOUSAND_OFFSET + (*readout_p_ / 1000);
-        int hundreds = HUNDRED_OFFSET + (*readout_p_ % 1000) / 100;
-        int tens = TENS_OFFSET + (*readout_p_ % 100) / 10;
-        int ones = (*readout_p_ % 10);
-        segments = display_data[thousands][seq] |
-                   display_data[hundreds][seq]  |
-                   display_data[tens][seq]      |
-                   display_data[ones][seq];
-
-        if(show_dots) {
-            segments |= display_data[DOTS][seq];
+    if (value < 3000) {
+        uint16_t bcd = bin_to_bcd(value);
+        uint8_t thousands = THOUSAND_OFFSET + (bcd >> 12);
+        uint8_t hundreds = HUNDRED_OFFSET + ((bcd >> 8) & 0x0F);
+        uint8_t tens = TENS_OFFSET + ((bcd >> 4) & 0x0F);
+        uint8_t ones = bcd & 0x0F;
+
+        for(uint8_t seq = 0; seq < 2; seq++) {
+            frame_[seq] = font_word(thousands, seq) |
+                          font_word(hundreds, seq)  |
+                          font_word(tens, seq)      |
+                          font_word(ones, seq);
+
+            if(show_dots) {
+                frame_[seq] |= font_word(DOTS, seq);
+            }
         }
-        return segments;
     } else {
         /* Other values mapped to special text strings */
-        switch(*readout_p_) {
-        case DISPLAY_CUR:
-            return display_data[CUR][seq];
-        default:
-            return 0;
+        uint16_t row = STRINGS + (value - DISPLAY_CUR);
+        for(uint8_t seq = 0; seq < 2; seq++) {
+            frame_[seq] = row < FONT_ROWS ? font_word(row, seq) : 0;
         }
     }
 }
 
+#define DISPLAY_REFRESH_MS 10
+
 void display_handler(uint16_t null) {
-    spi_send_word(get_readout_segments(seq_nbr % 2));
+    profile_display_refresh(DISPLAY_REFRESH_MS);
+
+    uint16_t value = *readout_p_;
+    if(frame_dirty_ || value != frame_value_) {
+        frame_dirty_ = 0;
+        frame_value_ = value;
+        render_frame(value);
+    }
+
+    spi_send_word(frame_[seq_nbr % 2]);
     seq_nbr++;
 
     // 100Hz refresh-rate
-    evq_timed_push(display_handler, 0, 10);
+    evq_timed_push(display_handler, 0, DISPLAY_REFRESH_MS, EVQ_NORMAL);
 }
 
 
@@ -148,10 +258,10 @@ void status_led_toggle(uint16_t led) {
 void blink_led(uint16_t led, uint16_t time) {
     if(status_led_status(led)) {
         status_led_off(led);
-        evq_timed_push(status_led_on, led, time);
+        evq_timed_push(status_led_on, led, time, EVQ_NORMAL);
     } else {
         status_led_on(led);
-        evq_timed_push(status_led_off, led, time);
+        evq_timed_push(status_led_off, led, time, EVQ_NORMAL);
     }
 }
 
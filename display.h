@@ -12,8 +12,15 @@
 #include <inttypes.h>
 #include <avr/io.h>
 
+/* Values from 3000 on show text instead of a number */
 enum special_display {
-    DISPLAY_CUR = 3000
+    DISPLAY_CUR = 3000, // "cur"
+    DISPLAY_OL,         // " OL", over range
+    DISPLAY_CC,         // " CC", constant current
+    DISPLAY_CV,         // " CU", constant voltage
+    DISPLAY_ERR,        // "Err"
+    DISPLAY_VOLTS,      // "  U"
+    DISPLAY_AMPS        // "  A"
 };
 
 /* This function should be called at program startup */
@@ -24,8 +31,16 @@ void set_static_readout(uint16_t readout);
 
 void display_dots(void);
 
+/* PD0 and PD1 are RXD and TXD of the UART, status LEDs are left out when
+ * it is in use
+ */
+#ifdef UART_BAUD
+#define LED_VOLTAGE 0
+#define LED_CURRENT 0
+#else
 #define LED_VOLTAGE (_BV(PD0))
 #define LED_CURRENT (_BV(PD1))
+#endif
 
 void status_led_on(uint16_t led);
 void status_led_off(uint16_t led);
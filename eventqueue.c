@@ -8,124 +8,701 @@
 
 #include "eventqueue.h"
 #include "display.h"
+#include "peripherals.h"
+#include "profile.h"
 #include <inttypes.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/atomic.h>
 
-// FIFO - ring buffer
-#define BUFMAX 64
-uint8_t events_ = 0;
-event ebuf_[BUFMAX];
-event *first_ = ebuf_;
-event *last_ = ebuf_;
+/* STATISTICS --------------------------------------------------------------- */
 
-uint8_t evq_push(void (*callback)(uint16_t), uint16_t data) {
+#ifdef EVQ_STATS
+
+evq_stats stats_;
+
+const evq_stats* evq_get_stats(void) {
+    return &stats_;
+}
+
+void evq_reset_stats(void) {
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        if(events_ >= BUFMAX) {
-            // buffer is full
-            return 0;
+        uint8_t *bytes = (uint8_t*)&stats_;
+        for(uint16_t idx = 0; idx < sizeof(stats_); idx++) {
+            bytes[idx] = 0;
         }
+    }
+}
 
-        if(last_ >= ebuf_ + BUFMAX) {
-            // jumb back to start if over the end of the ring
-            last_ = ebuf_;
+/* Returns statistics entry of callback, or 0 if the table is full.
+ * Entries are added from ISRs too, call with interrupts disabled.
+ */
+evq_handler_stats* stats_handler(void (*callback)(uint16_t)) {
+    for(uint8_t idx = 0; idx < EVQ_STATS_HANDLERS; idx++) {
+        evq_handler_stats *hs = &stats_.handlers[idx];
+        if(hs->callback == callback) {
+            return hs;
+        }
+        if(hs->callback == 0) {
+            hs->callback = callback;
+            return hs;
         }
+    }
+    return 0;
+}
 
-        event new_event = {callback, data};
-        *last_ = new_event;
-        last_++;
-        events_++;
+/* Call with interrupts disabled, pushes come from ISRs too */
+void stats_push(void (*callback)(uint16_t), uint8_t priority, uint8_t count) {
+    if(count == 0) {
+        stats_.push_failures[priority]++;
+        evq_handler_stats *hs = stats_handler(callback);
+        if(hs) {
+            hs->push_failures++;
+        }
+    } else if(count > stats_.high_water[priority]) {
+        stats_.high_water[priority] = count;
     }
-    return events_;
+}
+
+void stats_dispatch(void (*callback)(uint16_t), uint16_t time) {
+    uint8_t bucket = 0;
+    for(uint16_t t = time; t && bucket < EVQ_STATS_BUCKETS - 1; t >>= 1) {
+        bucket++;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        evq_handler_stats *hs = stats_handler(callback);
+        if(hs) {
+            hs->histogram[bucket]++;
+            if(time > hs->max_time) {
+                hs->max_time = time;
+            }
+        }
+    }
+}
+
+/* Call with interrupts disabled */
+void stats_timers(uint8_t pushed, uint8_t in_use) {
+    if(!pushed) {
+        stats_.timer_failures++;
+    } else if(in_use > stats_.timers_high_water) {
+        stats_.timers_high_water = in_use;
+    }
+}
+
+#else
+
+#define stats_push(callback, priority, count)
+#define stats_dispatch(callback, time)
+#define stats_timers(pushed, in_use)
+
+#endif
+
+// FIFO - one ring buffer per priority
+typedef struct {
+    event *buf;
+    uint8_t size;
+    uint8_t count;
+    uint8_t first;
+    uint8_t last;
+    uint8_t merge;  // position of the latest evq_push_merge() event
+} evq_ring;
+
+event critical_ebuf_[EVQ_CRITICAL_BUFMAX];
+event normal_ebuf_[EVQ_NORMAL_BUFMAX];
+event background_ebuf_[EVQ_BACKGROUND_BUFMAX];
+
+evq_ring rings_[EVQ_PRIORITIES] = {
+    { critical_ebuf_, EVQ_CRITICAL_BUFMAX, 0, 0, 0, 0 },
+    { normal_ebuf_, EVQ_NORMAL_BUFMAX, 0, 0, 0, 0 },
+    { background_ebuf_, EVQ_BACKGROUND_BUFMAX, 0, 0, 0, 0 }
+};
+
+// ring of the event returned by last evq_front()
+uint8_t front_prio_ = 0;
+
+/* Call with interrupts disabled */
+uint8_t ring_push(void (*callback)(uint16_t), uint16_t data, uint8_t priority) {
+    evq_ring *ring = &rings_[priority];
+
+    if(ring->count >= ring->size) {
+        // buffer is full
+        stats_push(callback, priority, 0);
+        return 0;
+    }
+
+    event new_event = {callback, data};
+    ring->buf[ring->last] = new_event;
+    if(++ring->last >= ring->size) {
+        // jump back to start if over the end of the ring
+        ring->last = 0;
+    }
+    uint8_t count = ++ring->count;
+    stats_push(callback, priority, count);
+    return count;
+}
+
+uint8_t evq_push(void (*callback)(uint16_t), uint16_t data, uint8_t priority) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_SCOPE(PROF_EVQ_PUSH);
+        return ring_push(callback, data, priority);
+    }
+    return 0;
+}
+
+/* The front event may already be running, so only events behind it are
+ * merged into.
+ */
+uint8_t evq_push_merge(void (*callback)(uint16_t), int16_t delta,
+                       uint8_t priority)
+{
+    evq_ring *ring = &rings_[priority];
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_SCOPE(PROF_EVQ_PUSH);
+        uint8_t pos = ring->merge;
+        uint8_t behind_front = pos >= ring->first ? pos - ring->first
+                                                  : pos + ring->size - ring->first;
+
+        if(behind_front > 0 && behind_front < ring->count &&
+           ring->buf[pos].callback == callback) {
+            ring->buf[pos].data += delta;
+            return ring->count;
+        }
+
+        uint8_t count = ring_push(callback, (uint16_t)delta, priority);
+        if(count) {
+            ring->merge = (ring->last ? ring->last : ring->size) - 1;
+        }
+        return count;
+    }
+    return 0;
 }
 
 void evq_pop() {
+    evq_ring *ring = &rings_[front_prio_];
+
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        if(events_ > 0) {
+        PROFILE_SCOPE(PROF_EVQ_POP);
+        if(ring->count > 0) {
             // buffer is not empty
-            events_--;
-            first_++;
+            ring->count--;
+            if(++ring->first >= ring->size) {
+                // jump back to start if over the end of the ring
+                ring->first = 0;
+            }
+        }
+    }
+}
+
+/* Strict priority: lower priority rings are served only when all rings
+ * above them are empty.
+ */
+event* evq_front() {
+    for(uint8_t prio = 0; prio < EVQ_PRIORITIES; prio++) {
+        evq_ring *ring = &rings_[prio];
+        if(ring->count > 0) {
+            front_prio_ = prio;
+            return &ring->buf[ring->first];
         }
+    }
+    // all buffers are empty
+    return 0;
+}
 
-        if(first_ >= ebuf_ + BUFMAX) {
-            // jump back to start if over the end of the ring
-            first_ = ebuf_;
+/* DISPATCH ----------------------------------------------------------------- */
+
+void evq_dispatch(void) {
+    event* ep = evq_front();
+    if(ep != 0) {
+        if(ep->callback) {
+#if defined(EVQ_STATS) || defined(PROFILE)
+            uint16_t start = cycle_timer_now();
+            ep->callback(ep->data);
+            uint16_t time = cycle_timer_now() - start;
+            stats_dispatch(ep->callback, time);
+            profile_record(PROF_DISPATCH, time);
+#else
+            ep->callback(ep->data);
+#endif
         }
+        evq_pop();
     }
 }
 
-event* evq_front() {
-    if(events_ == 0) {
-        // buffer is empty
-        return 0;
+/* Sleep/dispatch ratio is sampled by the 1ms timer tick, or measured from
+ * the clock around sleep when ticks are not counted
+ */
+volatile uint8_t sleeping_ = 0;
+#ifdef EVQ_TICKLESS
+#define TICK_BITS 3
+uint32_t clock_counts(void);
+uint32_t sleep_counts_ = 0;
+#else
+evq_load_stats load_stats_;
+#endif
+
+/* Interrupts are disabled while the queue is checked. sei() enables them
+ * only after the following instruction, so an ISR which pushes an event
+ * between the check and sleep_cpu() wakes the CPU instead of being lost.
+ */
+void evq_idle(void) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    if(evq_front() == 0) {
+        sleeping_ = 1;
+#ifdef EVQ_TICKLESS
+        uint16_t start = clock_counts();
+#endif
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        sleeping_ = 0;
+#ifdef EVQ_TICKLESS
+        // a sleep ends at the latest on the next overflow, 16 bits is enough
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            sleep_counts_ += (uint16_t)clock_counts() - start;
+        }
+#endif
+    } else {
+        sei();
+    }
+}
+
+void evq_load(evq_load_stats* stats) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+#ifdef EVQ_TICKLESS
+        stats->sleep_ticks = sleep_counts_ >> TICK_BITS;
+        stats->busy_ticks = (clock_counts() >> TICK_BITS) - stats->sleep_ticks;
+#else
+        *stats = load_stats_;
+#endif
     }
-    return first_;
 }
 
 /* TIMED EVENTS ------------------------------------------------------------- */
 
-/* Timer will give interrupt every (1) millisecond */
+void init_timer_wheel(void);
+
+/* Timer will give interrupt every (1) millisecond, or with EVQ_TICKLESS
+ * only when a timed event is due and on overflows of the clock
+ */
 void init_evq_timer(void) {
+    init_timer_wheel();
+#if defined(EVQ_STATS) || defined(PROFILE)
+    init_cycle_timer();
+#endif
+
+#ifdef EVQ_TICKLESS
+    // normal mode, compare match A is armed by timer_arm()
+    TCCR2B |= _BV(CS22) | _BV(CS21) | _BV(CS20); // clk/1024
+    TIMSK2 |= _BV(TOIE2);
+#else
     TCCR2A |= _BV(WGM21); // CTC
     OCR2A = 8; // ~1ms
     TCCR2B |= _BV(CS22) | _BV(CS21) | _BV(CS20); // clk/1024
     TIMSK2 |= _BV(OCIE2A);
+#endif
 }
 
+/* Hierarchical timer wheel
+ *
+ * Four levels of 16 slots: level 0 slots are 1 ms wide, level 1 slots 16 ms,
+ * level 2 256 ms and level 3 4096 ms. A timer is hooked into the level which
+ * covers its remaining time and is moved (cascaded) one level down when the
+ * level below wraps around. Every tick therefore touches one level 0 slot and,
+ * every 16th tick, one slot of the level above.
+ *
+ * Timers are identified by their callback and data values. Each key is also
+ * chained into a small hash table so that a push with an existing key can
+ * replace the pending timer instead of adding a second one.
+ */
+#define WHEEL_BITS 4
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define NIL 0xFF
+
 typedef struct {
     event data;
-    uint16_t timer;
+    uint16_t expires;
+    uint8_t priority;
+    uint8_t slot;       // wheel slot the timer is linked into
+    uint8_t next;       // next timer in the same wheel slot / free list
+    uint8_t prev;       // previous timer in the same wheel slot
+    uint8_t key_next;   // next timer in the same key bucket
 } timed_event;
 
-#define TIMED_BUFMAX 31
-timed_event timed_ebuf_[TIMED_BUFMAX];
+#if EVQ_TIMED_BUFMAX > 254
+#error "EVQ_TIMED_BUFMAX must leave index 0xFF for NIL"
+#endif
+
+// key chains stay a few timers long
+#if EVQ_TIMED_BUFMAX > 64
+#define KEY_BUCKETS 32
+#elif EVQ_TIMED_BUFMAX > 32
+#define KEY_BUCKETS 16
+#else
+#define KEY_BUCKETS 8
+#endif
+
+timed_event timed_ebuf_[EVQ_TIMED_BUFMAX];
+uint8_t wheel_[WHEEL_LEVELS * WHEEL_SIZE];
+uint8_t key_bucket_[KEY_BUCKETS];
+uint8_t free_timers_;
 uint8_t timed_events_ = 0;
+uint16_t wheel_time_ = 0; // tick which is processed next
 
-/* Implements small hash table for timed callback events
- * waitms is time in milliseconds after callback function is called.
+void init_timer_wheel(void) {
+    for(uint8_t idx = 0; idx < WHEEL_LEVELS * WHEEL_SIZE; idx++) {
+        wheel_[idx] = NIL;
+    }
+    for(uint8_t idx = 0; idx < KEY_BUCKETS; idx++) {
+        key_bucket_[idx] = NIL;
+    }
+    for(uint8_t idx = 0; idx < EVQ_TIMED_BUFMAX; idx++) {
+        timed_ebuf_[idx].next = idx + 1 < EVQ_TIMED_BUFMAX ? idx + 1 : NIL;
+    }
+    free_timers_ = 0;
+}
+
+uint8_t key_hash(void (*callback)(uint16_t), uint16_t data) {
+    uint16_t k = (uint16_t)callback + data;
+    return (k ^ (k >> 8)) & (KEY_BUCKETS - 1);
+}
+
+/* Hooks timer into the wheel slot matching its remaining time */
+void wheel_link(uint8_t t) {
+    timed_event *te = &timed_ebuf_[t];
+    uint16_t delta = te->expires - wheel_time_;
+    uint8_t slot;
+
+    if(delta < WHEEL_SIZE) {
+        slot = te->expires & WHEEL_MASK;
+    } else if(delta < (1 << (2 * WHEEL_BITS))) {
+        slot = WHEEL_SIZE + ((te->expires >> WHEEL_BITS) & WHEEL_MASK);
+    } else if(delta < (1 << (3 * WHEEL_BITS))) {
+        slot = 2 * WHEEL_SIZE + ((te->expires >> (2 * WHEEL_BITS)) & WHEEL_MASK);
+    } else {
+        slot = 3 * WHEEL_SIZE + ((te->expires >> (3 * WHEEL_BITS)) & WHEEL_MASK);
+    }
+
+    te->slot = slot;
+    te->prev = NIL;
+    te->next = wheel_[slot];
+    if(te->next != NIL) {
+        timed_ebuf_[te->next].prev = t;
+    }
+    wheel_[slot] = t;
+}
+
+void wheel_unlink(uint8_t t) {
+    timed_event *te = &timed_ebuf_[t];
+    if(te->prev != NIL) {
+        timed_ebuf_[te->prev].next = te->next;
+    } else {
+        wheel_[te->slot] = te->next;
+    }
+    if(te->next != NIL) {
+        timed_ebuf_[te->next].prev = te->prev;
+    }
+}
+
+/* Returns index of pending timer with given key or NIL */
+uint8_t timer_find(void (*callback)(uint16_t), uint16_t data) {
+    uint8_t t = key_bucket_[key_hash(callback, data)];
+    while(t != NIL && (timed_ebuf_[t].data.callback != callback ||
+                       timed_ebuf_[t].data.data != data)) {
+        t = timed_ebuf_[t].key_next;
+    }
+    return t;
+}
+
+/* Unlinks timer from its key bucket and returns it to the free list */
+void timer_release(uint8_t t) {
+    timed_event *te = &timed_ebuf_[t];
+    uint8_t *link = &key_bucket_[key_hash(te->data.callback, te->data.data)];
+    while(*link != t) {
+        link = &timed_ebuf_[*link].key_next;
+    }
+    *link = te->key_next;
+
+    te->next = free_timers_;
+    free_timers_ = t;
+    timed_events_--;
+}
+
+#ifdef EVQ_TICKLESS
+void timer_catch_up(void);
+void timer_arm(void);
+#else
+#define timer_catch_up()
+#define timer_arm()
+#endif
+
+/* waitms is time in milliseconds after callback function is called.
  *
  * If user pushes event with same callback and data values the old one is
- * overwritten.
+ * replaced, so the timer restarts from waitms.
  */
-void evq_timed_push(void (*callback)(uint16_t),
-                    uint16_t data,
-                    uint16_t waitms)
+uint8_t evq_timed_push(void (*callback)(uint16_t),
+                       uint16_t data,
+                       uint16_t waitms,
+                       uint8_t priority)
 {
-    timed_event timed_ev = {{callback, data}, waitms};
+    if(waitms == 0) {
+        waitms = 1;
+    } else if(waitms > EVQ_TIMED_MAXMS) {
+        waitms = EVQ_TIMED_MAXMS;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_SCOPE(PROF_EVQ_TIMED);
+        timer_catch_up();
+        uint8_t t = timer_find(callback, data);
+        if(t != NIL) {
+            wheel_unlink(t);
+        } else {
+            if(free_timers_ == NIL) {
+                // all timers in use
+                stats_timers(0, timed_events_);
+                return 0;
+            }
+            t = free_timers_;
+            free_timers_ = timed_ebuf_[t].next;
+            timed_events_++;
+            stats_timers(1, timed_events_);
+
+            uint8_t *bucket = &key_bucket_[key_hash(callback, data)];
+            timed_ebuf_[t].data.callback = callback;
+            timed_ebuf_[t].data.data = data;
+            timed_ebuf_[t].key_next = *bucket;
+            *bucket = t;
+        }
+
+        // fires on the waitms'th tick from now
+        timed_ebuf_[t].priority = priority;
+        timed_ebuf_[t].expires = wheel_time_ + waitms - 1;
+        wheel_link(t);
+        timer_arm();
+    }
+    return 1;
+}
 
-    uint16_t k = (uint16_t)callback+data;
-    uint8_t hash = (k*(k+3)) % TIMED_BUFMAX;
+uint8_t evq_timers_in_use(void) {
+    return timed_events_;
+}
+
+uint16_t evq_time(void) {
+    uint16_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+#ifdef EVQ_TICKLESS
+        now = clock_counts() >> TICK_BITS;
+#else
+        now = wheel_time_;
+#endif
+    }
+    return now;
+}
 
+void evq_timed_cancel(void (*callback)(uint16_t), uint16_t data) {
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        timed_ebuf_[hash] = timed_ev;
-        // TODO: etsi vapaa kohta
-        // timed_ebuf_[hash].data.callback == callback
+        uint8_t t = timer_find(callback, data);
+        if(t != NIL) {
+            wheel_unlink(t);
+            timer_release(t);
+        }
+    }
+}
+
+/* Detaches the list of a higher level slot and hooks its timers back in,
+ * which moves them one level down. Returns index of the cascaded slot.
+ */
+uint8_t wheel_cascade(uint8_t level) {
+    uint8_t idx = (wheel_time_ >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    uint8_t t = wheel_[level * WHEEL_SIZE + idx];
+    wheel_[level * WHEEL_SIZE + idx] = NIL;
+
+    while(t != NIL) {
+        uint8_t next = timed_ebuf_[t].next;
+        wheel_link(t);
+        t = next;
     }
+    return idx;
 }
 
-/* Loops through hash table and pushes events which timer has reached zero
- * to event queue.
+/* Cascades higher levels when level 0 wraps around and pushes events of the
+ * current level 0 slot to event queue.
  *
- * TIMER2 ISR calls this function every 1 millisecond
+ * TIMER2 ISR calls this function every 1 millisecond, with EVQ_TICKLESS
+ * timer_catch_up() calls it for the elapsed ticks which have work to do
  */
 void evq_timer_tick() {
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    for(int idx = 0; idx < TIMED_BUFMAX; idx++) {
-        if(--timed_ebuf_[idx].timer == 0 &&
-             timed_ebuf_[idx].data.callback != 0) {
-            if(evq_push(timed_ebuf_[idx].data.callback,
-                        timed_ebuf_[idx].data.data)) {
-                timed_ebuf_[idx].data.callback = 0; // mark as done
-            } else {
-                // there is no space in evq, try again next round
-                timed_ebuf_[idx].timer++;
+    uint8_t idx = wheel_time_ & WHEEL_MASK;
+    if(idx == 0) {
+        for(uint8_t level = 1; level < WHEEL_LEVELS; level++) {
+            if(wheel_cascade(level) != 0) {
+                break;
             }
         }
     }
+
+    uint8_t t = wheel_[idx];
+    wheel_[idx] = NIL;
+    while(t != NIL) {
+        timed_event *te = &timed_ebuf_[t];
+        uint8_t next = te->next;
+
+        if(evq_push(te->data.callback, te->data.data, te->priority)) {
+            timer_release(t);
+        } else {
+            // there is no space in evq, try again next round
+            te->expires = wheel_time_ + 1;
+            wheel_link(t);
+        }
+        t = next;
+    }
+
+    wheel_time_++;
+}
+
+#ifdef EVQ_TICKLESS
+
+/* Tickless clock ------------------------------------------------------------
+ *
+ * TIMER2 runs freely at clk/1024 and its overflows extend it to 32 bits. A
+ * tick is 8 counts (1.024 ms), so the 8-bit counter overflows every 32
+ * ticks. The overflow interrupt keeps the clock and bounds how many ticks a
+ * catch-up has to cover. Compare match A is armed only when the next tick
+ * with work comes before the next overflow.
+ */
+#define TICK_COUNTS (1 << TICK_BITS)
+#define NO_DEADLINE 0xFFFF
+
+volatile uint32_t timer2_overflows_ = 0;
+
+/* Call with interrupts disabled */
+uint32_t clock_counts(void) {
+    uint8_t low = TCNT2;
+    uint32_t high = timer2_overflows_;
+    if((TIFR2 & _BV(TOV2)) && low < 0x80) {
+        // overflowed after interrupts were disabled
+        high++;
+    }
+    return (high << 8) | low;
+}
+
+/* Ticks from wheel_time_ to the next tick which has work: a level 0 slot
+ * with timers or the cascade of a non-empty slot above. Levels 2 and 3 are
+ * only checked up to their next cascade.
+ */
+uint16_t wheel_next(void) {
+    uint16_t next = NO_DEADLINE;
+    if(timed_events_ == 0) {
+        return next;
+    }
+
+    for(uint8_t k = 0; k < WHEEL_SIZE; k++) {
+        if(wheel_[(wheel_time_ + k) & WHEEL_MASK] != NIL) {
+            next = k;
+            break;
+        }
+    }
+
+    // level 1 cascades when level 0 wraps
+    uint16_t at = -wheel_time_ & WHEEL_MASK;
+    for(uint8_t k = 0; k < WHEEL_SIZE && at < next; k++, at += WHEEL_SIZE) {
+        uint8_t idx = ((wheel_time_ + at) >> WHEEL_BITS) & WHEEL_MASK;
+        if(wheel_[WHEEL_SIZE + idx] != NIL) {
+            next = at;
+        }
+    }
+
+    // levels 2 and 3 when level 1 wraps
+    at = -wheel_time_ & ((1 << (2 * WHEEL_BITS)) - 1);
+    for(uint8_t idx = 2 * WHEEL_SIZE; idx < WHEEL_LEVELS * WHEEL_SIZE &&
+                                      at < next; idx++) {
+        if(wheel_[idx] != NIL) {
+            next = at;
+        }
+    }
+    return next;
+}
+
+/* Runs the elapsed ticks which have work, others are skipped over.
+ * Call with interrupts disabled.
+ */
+void timer_catch_up(void) {
+    uint16_t elapsed = (uint16_t)(clock_counts() >> TICK_BITS) - wheel_time_;
+    while(elapsed) {
+        uint16_t next = wheel_next();
+        if(next >= elapsed) {
+            wheel_time_ += elapsed;
+            return;
+        }
+        wheel_time_ += next;
+        elapsed -= next + 1;
+        evq_timer_tick();
+    }
+}
+
+/* Catches up and arms compare match A for the end of the next tick with
+ * work. Call with interrupts disabled.
+ */
+void timer_arm(void) {
+    for(;;) {
+        timer_catch_up();
+        uint16_t next = wheel_next();
+        uint32_t now = clock_counts();
+        if((uint16_t)(now >> TICK_BITS) != wheel_time_) {
+            // a tick ended meanwhile
+            continue;
+        }
+
+        uint8_t low = now;
+        // counts to the end of tick next, which is under 256 ticks when set
+        uint16_t due = next == NO_DEADLINE ? NO_DEADLINE :
+                       (next + 1) * TICK_COUNTS - (low & (TICK_COUNTS - 1));
+        if(due >= 256 - low) {
+            // nothing due before the overflow, which re-arms
+            TIMSK2 &= ~_BV(OCIE2A);
+            return;
+        }
+
+        OCR2A = low + due;
+        TIFR2 = _BV(OCF2A); // drop a stale match
+        TIMSK2 |= _BV(OCIE2A);
+        if((uint8_t)(TCNT2 - low) < due) {
+            return;
+        }
+        // counter reached the match while arming
     }
 }
 
+ISR(TIMER2_OVF_vect) {
+    PROFILE_SCOPE(PROF_TIMER2);
+    timer2_overflows_++;
+    timer_arm();
+}
+
 ISR(TIMER2_COMPA_vect) {
+    PROFILE_SCOPE(PROF_TIMER2);
+    timer_arm();
+}
+
+#else
+
+ISR(TIMER2_COMPA_vect) {
+    PROFILE_SCOPE(PROF_TIMER2);
+    if(sleeping_) {
+        load_stats_.sleep_ticks++;
+    } else {
+        load_stats_.busy_ticks++;
+    }
+
     // tick 1ms intervals
     evq_timer_tick();
 }
+
+#endif
@@ -17,32 +17,166 @@ typedef struct event {
 } event;
 
 /**
- * Adds a new element at the end of the queue 
- * Returns number of events in buffer on success and 0 on failure
+ * Each priority has its own ring buffer. Events of a priority are
+ * dispatched only when all higher priority rings are empty.
  */
-uint8_t evq_push(void (*callback)(uint16_t), uint16_t data);
+typedef enum {
+    EVQ_CRITICAL,   // current measurement and limiting
+    EVQ_NORMAL,     // user interface
+    EVQ_BACKGROUND, // persistence
+    EVQ_PRIORITIES
+} evq_priority;
 
 /**
- * Returns a pointer to the first event in the queue 
+ * Ring buffer capacities, can be overridden at compile time. Together they
+ * hold the 64 events of the former single queue.
+ *
+ * Normal ring must take a tick in which every pending timer fires
+ * (EVQ_TIMED_BUFMAX at most, two of them are background saves) plus the ISR pushes of knobs,
+ * buttons, SPI, EEPROM and UART, one or two each. Background holds at most
+ * two settings saves and one report of each kind. Critical ring gets one
+ * sample per conversion, ~0.2 ms, and takes the rest so a callback may
+ * run ~5 ms before samples are dropped.
+ */
+#ifndef EVQ_CRITICAL_BUFMAX
+#define EVQ_CRITICAL_BUFMAX 24
+#endif
+#ifndef EVQ_NORMAL_BUFMAX
+#define EVQ_NORMAL_BUFMAX 32
+#endif
+#ifndef EVQ_BACKGROUND_BUFMAX
+#define EVQ_BACKGROUND_BUFMAX 8
+#endif
+
+/**
+ * Adds a new element at the end of the queue of given priority
+ * Returns number of events in that buffer on success and 0 on failure
+ */
+uint8_t evq_push(void (*callback)(uint16_t), uint16_t data, uint8_t priority);
+
+/**
+ * Like evq_push, but if the latest merged event of the queue is still
+ * waiting behind the front with the same callback, delta is added to its
+ * data instead of using a new slot. Callback receives the accumulated
+ * delta as (int16_t)data.
+ */
+uint8_t evq_push_merge(void (*callback)(uint16_t), int16_t delta,
+                       uint8_t priority);
+
+/**
+ * Returns a pointer to the first event of the highest priority non-empty
+ * queue
  */
 event* evq_front();
 
 /**
- * Removes the first element in the queue 
+ * Removes the element returned by the last evq_front()
  */
 void evq_pop();
 
 /**
- * This function should be called at program startup 
+ * Runs the front event, if any
+ */
+void evq_dispatch(void);
+
+/**
+ * Puts the CPU to idle sleep if no events are queued. Returns after the
+ * next interrupt, or immediately if events are waiting.
+ */
+void evq_idle(void);
+
+/**
+ * Number of 1ms ticks which found the CPU asleep or running. Sleep share
+ * of the total is the headroom left in the event loop. With EVQ_TICKLESS
+ * there is no tick interrupt to sample with, the time asleep is measured
+ * from the timer instead.
+ */
+typedef struct {
+    uint32_t sleep_ticks;
+    uint32_t busy_ticks;
+} evq_load_stats;
+
+void evq_load(evq_load_stats* stats);
+
+/**
+ * Statistics, compiled in only if EVQ_STATS is defined. Times are counts
+ * of cycle_timer_now().
+ */
+#ifndef EVQ_STATS_HANDLERS
+#define EVQ_STATS_HANDLERS 8
+#endif
+
+// bucket n counts callbacks which took [2^(n-1), 2^n) counts, last is open
+#define EVQ_STATS_BUCKETS 10
+
+typedef struct {
+    void (*callback)(uint16_t);
+    uint16_t push_failures;
+    uint16_t max_time;
+    uint16_t histogram[EVQ_STATS_BUCKETS];
+} evq_handler_stats;
+
+typedef struct {
+    uint8_t high_water[EVQ_PRIORITIES];
+    uint16_t push_failures[EVQ_PRIORITIES];
+    uint8_t timers_high_water;
+    uint16_t timer_failures;
+    // first EVQ_STATS_HANDLERS callbacks seen, in order of appearance
+    evq_handler_stats handlers[EVQ_STATS_HANDLERS];
+} evq_stats;
+
+#ifdef EVQ_STATS
+const evq_stats* evq_get_stats(void);
+void evq_reset_stats(void);
+#endif
+
+/**
+ * Number of timed events currently pending
+ */
+uint8_t evq_timers_in_use(void);
+
+/**
+ * This function should be called at program startup
+ *
+ * If EVQ_TICKLESS is defined TIMER2 interrupts only when a timed event is
+ * due and on its overflows, about 30 times a second, instead of on every
+ * tick. A tick is then 1.024 ms instead of 1.152 ms.
  */
 void init_evq_timer(void);
 
 /**
- * Adds new elvent to be executed after waitms milliseconds has eplapsed
- * Returns number of events in buffer on success and 0 on failure 
+ * Longest supported delay of a timed event, longer delays are clamped
+ */
+#define EVQ_TIMED_MAXMS 61440
+
+/**
+ * Number of timers, can be overridden at compile time. A push replaces the
+ * pending timer of its callback and data, so a timer per key is enough.
+ * The default covers the firmware's own timers with room for remote and
+ * report handlers.
+ */
+#ifndef EVQ_TIMED_BUFMAX
+#define EVQ_TIMED_BUFMAX 24
+#endif
+
+/**
+ * Adds new event to be executed after waitms milliseconds has elapsed.
+ * A pending event with the same callback and data is replaced.
+ * Returns 1 on success and 0 if all timers are in use
  */
-void evq_timed_push(void (*callback)(uint16_t),
+uint8_t evq_timed_push(void (*callback)(uint16_t),
                        uint16_t data,
-                       uint16_t waitms);
+                       uint16_t waitms,
+                       uint8_t priority);
+
+/**
+ * Returns milliseconds elapsed since timer start, wraps around
+ */
+uint16_t evq_time(void);
+
+/**
+ * Removes pending timed event with given callback and data, if any
+ */
+void evq_timed_cancel(void (*callback)(uint16_t), uint16_t data);
 
 #endif
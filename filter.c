@@ -0,0 +1,63 @@
+/*
+ * filter.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "filter.h"
+#include <inttypes.h>
+
+/* Oversample and decimate ---------------------------------------------------
+ *
+ * Sum of 4^n samples is divided by 4^n, which is a plain average with no
+ * extra bits in its format. Samples come with FILTER_FRAC_BITS fraction
+ * bits below the 1mA ADC step, so the up to n bits of resolution that noise
+ * on the input lets averaging gain fit in the fraction of the average
+ * instead of being rounded off.
+ */
+#define DECIMATION (1 << (2 * FILTER_OVERSAMPLE_BITS))
+
+uint32_t decim_sum_ = 0;
+uint16_t decim_count_ = 0;
+
+/* IIR ---------------------------------------------------------------------
+ *
+ * y += (x - y) / 2^shift, state is kept scaled by 2^shift so no bits are
+ * lost in the division.
+ */
+uint32_t iir_state_ = 0;
+uint8_t iir_primed_ = 0;
+
+void filter_reset(void) {
+    decim_sum_ = 0;
+    decim_count_ = 0;
+    iir_state_ = 0;
+    iir_primed_ = 0;
+}
+
+uint8_t filter_push(uint16_t sample) {
+    decim_sum_ += sample;
+    if(++decim_count_ < DECIMATION) {
+        return 0;
+    }
+
+    uint16_t decimated = decim_sum_ >> (2 * FILTER_OVERSAMPLE_BITS);
+    decim_sum_ = 0;
+    decim_count_ = 0;
+
+    if(!iir_primed_) {
+        // start from the first output instead of ramping up from zero
+        iir_state_ = (uint32_t)decimated << FILTER_IIR_SHIFT;
+        iir_primed_ = 1;
+    } else {
+        iir_state_ -= iir_state_ >> FILTER_IIR_SHIFT;
+        iir_state_ += decimated;
+    }
+    return 1;
+}
+
+uint16_t filter_output(void) {
+    return iir_state_ >> FILTER_IIR_SHIFT;
+}
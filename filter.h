@@ -0,0 +1,48 @@
+/*
+ * filter.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <inttypes.h>
+
+/* Samples and outputs are fixed point with FILTER_FRAC_BITS fraction bits */
+#define FILTER_FRAC_BITS 4
+
+/* 4^FILTER_OVERSAMPLE_BITS samples are averaged into one decimated output,
+ * the resolution it gains is kept in the fraction bits
+ */
+#ifndef FILTER_OVERSAMPLE_BITS
+#define FILTER_OVERSAMPLE_BITS 2
+#endif
+
+#if FILTER_OVERSAMPLE_BITS > FILTER_FRAC_BITS
+#error "FILTER_OVERSAMPLE_BITS must not exceed FILTER_FRAC_BITS"
+#endif
+
+/* Decimated outputs are smoothed with an IIR of time constant
+ * 2^FILTER_IIR_SHIFT outputs, 0 disables the stage
+ */
+#ifndef FILTER_IIR_SHIFT
+#define FILTER_IIR_SHIFT 3
+#endif
+
+void filter_reset(void);
+
+/**
+ * Feeds one sample to the filter
+ * Returns 1 when a new decimated output was produced, 0 otherwise
+ */
+uint8_t filter_push(uint16_t sample);
+
+/**
+ * Returns latest filtered value
+ */
+uint16_t filter_output(void);
+
+#endif /* FILTER_H_ */
@@ -11,11 +11,22 @@
 #include "controls.h"
 #include "display.h"
 #include "eventqueue.h"
+#include "settings.h"
+#include "scpi.h"
 
 void initialize(void) {
-    init_evq_timer();
+    uint16_t voltage, current_limit;
 
-    set_current_limit(read_eeprom_current_limit());
+    init_evq_timer();
+#ifdef SCPI
+    init_uart(scpi_line_handler);
+#elif defined(UART_BAUD)
+    init_uart(0);
+#endif
+
+    init_settings(&voltage, &current_limit);
+    set_current_limit(current_limit);
+    set_voltage(voltage);
     init_voltage_pwm();
     init_display();
     init_controls();
@@ -31,15 +42,8 @@ int main(void) {
 
     sei(); // enable interrupts
     while (1) {
-
-        event* ep = evq_front();
-        if(ep != 0) {
-            if(ep->callback) {
-                ep->callback(ep->data);
-                evq_pop();
-            }
-        }
-
+        evq_dispatch();
+        evq_idle();
     }
 
     return 1;
@@ -9,14 +9,23 @@
 #include "peripherals.h"
 #include "eventqueue.h"
 #include "display.h"
+#include "filter.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "regulator.h"
+#include "profile.h"
 #include <avr/interrupt.h>
 #include <inttypes.h>
 #include <avr/io.h>
-#include <avr/eeprom.h>
+#include <util/atomic.h>
 
 /* PWM ---------------------------------------------------------------------- */
 uint16_t voltage;
 
+// OCR1A value from control loop, applied while ADC ISR has not tripped
+volatile uint16_t pwm_duty_;
+uint8_t output_enabled_ = 1;
+
 void init_voltage_pwm(void) {
     // Waveform outputs
     DDRB |= _BV(PB1);
@@ -36,25 +45,24 @@ void init_voltage_pwm(void) {
     TCCR1B |= _BV(WGM12) | _BV(WGM13);
 
     ICR1 = 1000;
-    set_voltage(read_eeprom_voltage());
 
     // start
     TCCR1B |= _BV(CS10);
 }
 
+/* Sets the CV setpoint, control loop owns the duty */
 void set_voltage(uint16_t set_voltage) {
     unsigned int uplimit = 1060;
     unsigned int downlimit = 125;
 
-    if(set_voltage > downlimit && set_voltage <= uplimit) {
-        OCR1A = set_voltage - 125;
+    if(set_voltage > uplimit) {
+        set_voltage = uplimit;
+    } else if(set_voltage < downlimit) {
+        set_voltage = downlimit;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
         voltage = set_voltage;
-    } else if (set_voltage > uplimit) {
-        OCR1A = uplimit - 125;
-        voltage = uplimit;
-    } else {
-        OCR1A = 0;
-        voltage = downlimit;
     }
 }
 
@@ -62,85 +70,473 @@ uint16_t* get_voltage() {
     return &voltage;
 }
 
+/* Regulator can't be switched off, disabled output drops to its 1.25V
+ * minimum
+ */
+void set_output(uint8_t enable) {
+    output_enabled_ = enable;
+}
+
+uint8_t output_enabled(void) {
+    return output_enabled_;
+}
+
+// latest samples and their references, written by ADC ISR
+volatile uint16_t iout_sample_;
+volatile uint8_t iout_range_;
+#ifdef REGULATOR
+volatile uint16_t vout_sample_;
+volatile uint8_t vout_range_;
+#endif
+// set by ADC ISR while current is over the trip limit, trips counts onsets
+volatile uint8_t adc_tripped_ = 0;
+volatile uint8_t adc_trips_ = 0;
+
+uint16_t adc_to_current(uint16_t sample, uint8_t range);
+uint16_t adc_to_voltage(uint16_t sample, uint8_t range);
+void output_mode_handler(uint16_t mode);
+
+/* Control loop, called from ADC ISR every REG_DIVIDER'th conversion
+ *
+ * ADC converts back to back at a fixed rate, so the control rate and with
+ * it the loop gain is as steady as from a timer, without an interrupt of
+ * its own. TIMER1 overflow at PWM frequency would cost ~8000 interrupts a
+ * second only to count the divider.
+ */
+void control_update(void) {
+    PROFILE_SCOPE(PROF_CONTROL);
+    static uint8_t mode_reported = REG_MODE_CV;
+    static uint8_t trips_seen = 0;
+    static uint8_t resumed = REG_RETRIP_STEPS; // steps since the last trip
+
+    // a glitch trips once and the loop resumes from where it was. Tripping
+    // again soon after is an overload CC has not caught up with, resuming
+    // would only chop the output at the trip limit.
+    if(adc_trips_ != trips_seen) {
+        trips_seen = adc_trips_;
+        if(resumed < REG_RETRIP_STEPS) {
+            regulator_overload();
+        }
+        resumed = 0;
+    }
+
+    // output is cut while tripped, holding the loop keeps integrators from
+    // winding up against it
+    if(adc_tripped_) {
+        return;
+    }
+    if(resumed < REG_RETRIP_STEPS) {
+        resumed++;
+    }
+
+    if(output_enabled_) {
+#ifdef REGULATOR
+        uint16_t measured = adc_to_voltage(vout_sample_, vout_range_);
+#else
+        uint16_t measured = 0;
+#endif
+        pwm_duty_ = regulator_update(voltage, measured, *get_current_limit(),
+                                     adc_to_current(iout_sample_, iout_range_));
+    } else {
+        regulator_reset(0);
+        pwm_duty_ = 0;
+    }
+    OCR1A = pwm_duty_;
+
+    // retried next step if queue is full
+    uint8_t mode = regulator_mode();
+    if(mode != mode_reported && evq_push(output_mode_handler, mode, EVQ_NORMAL)) {
+        mode_reported = mode;
+    }
+}
+
 /* ADC ---------------------------------------------------------------------- */
 
 #define ADCREF11 1100
 #define ADCREFVCC 5000
-#define ADCREFINIT ADCREF11
 
-volatile unsigned int adc_reference;
+/*
+ * Gain = 13
+ * Rsense = 0.22ohm
+ * Vin = ADC * Vref / 1024
+ * current = Vin / Gain / Rsense
+ *
+ * => current [mA] = ADC * Vref [mV] * 100 / (1024 * 13 * 22)
+ *
+ * Computed as (ADC * K + 0.5) >> 16, where
+ * K = Vref * 100 * 2^16 / (1024 * 286) = Vref * 6400 / 286
+ * is rounded at compile time. Error of K adds less than 0.01mA over the
+ * whole ADC range, so the result is the exact value rounded to nearest.
+ * Shifting FILTER_FRAC_BITS less keeps that many fraction bits.
+ */
+#define ADC_MA_SHIFT 16
+#define ADC_MA_K(vref) (((uint32_t)(vref) * 6400 + 286 / 2) / 286)
+
+// settling samples convert with the 5V constant, which gives an upper bound
+const uint32_t adc_ma_k_[] = {
+    ADC_MA_K(ADCREF11), ADC_MA_K(ADCREFVCC), ADC_MA_K(ADCREFVCC)
+};
+
+#ifdef REGULATOR
+/*
+ * Output voltage is measured on ADC1 through a 100k/10k divider
+ *
+ * voltage [10mV] = ADC * Vref [mV] * 11 / (1024 * 10)
+ *
+ * Same (ADC * K + 0.5) >> 16 scheme as current, K = Vref * 11 * 32 / 5
+ */
+#define VOUT_DIVIDER 11
+#define ADC_VOUT_K(vref) (((uint32_t)(vref) * VOUT_DIVIDER * 32 + 5 / 2) / 5)
+
+const uint32_t adc_vout_k_[] = {
+    ADC_VOUT_K(ADCREF11), ADC_VOUT_K(ADCREFVCC), ADC_VOUT_K(ADCREFVCC)
+};
+#endif
+
+/* Current limit is held by the CC loop, ADC ISR only cuts the output if
+ * current overshoots the limit by this much
+ */
+#define TRIP_MARGIN_MA 100
+
+/* Auto-ranging --------------------------------------------------------------
+ *
+ * 1.1V reference reads up to 1.1V / 2.86V/A = 384mA. Range is switched up
+ * when current is predicted to pass 90% of that and down when it is
+ * predicted to stay under 75% of it, prediction is the latest sample plus
+ * trend over the time the switch takes to settle. Saturation on 1.1V
+ * switches up at once.
+ *
+ * After a switch AREF moves between 1.1V and 5V. Going up it is driven by
+ * AVCC and settles within a conversion, going down the internal reference
+ * discharges the AREF capacitor. Samples taken meanwhile are tagged
+ * ADC_RANGE_SETTLING: converted with the 5V constant they give an upper
+ * bound for current and with the 1.1V constant a lower bound.
+ */
+#define ADC_UP_COUNTS 920    // 345mA on 1.1V
+#define ADC_DOWN_COUNTS 169  // 288mA on 5V
+#define ADC_FULL_SCALE 1023
+
+/* Conversions tagged after a reference change. Down value is for 100nF at
+ * AREF, measure by logging a constant current across switches.
+ */
+#define ADC_SETTLE_UP 1
+#ifndef ADC_SETTLE_DOWN
+#define ADC_SETTLE_DOWN 16
+#endif
+
+/* Samples from deciding a switch to the first settled sample: one
+ * conversion in flight, then the settling window
+ */
+#define ADC_LOOKAHEAD_UP (1 + ADC_SETTLE_UP + 1)
+#define ADC_LOOKAHEAD_DOWN (1 + ADC_SETTLE_DOWN + 1)
+
+// trend is kept in 1/2^TREND_SHIFT counts per sample
+#define TREND_SHIFT 2
+
+// how often displayed current value is updated
+#define CURRENT_DISPLAY_MS 250
+
+volatile uint8_t adc_range_ = ADC_RANGE_11; // for next conversions
 uint16_t display_current;
+uint16_t last_current_; // mA, latest unfiltered sample
+uint8_t output_mode_ = REG_MODE_CV;
+
+// smallest ADC result which exceeds trip limit, per settled range
+volatile uint16_t adc_trip_limit_[2];
+#define ADC_NO_TRIP 0xFFFF
+
+// current samples are passed to current_handeler with range in these bits
+#define SAMPLE_RANGE_SHIFT 14
+#define SAMPLE_MASK 0x03FF
+
+void update_trip_limit(void);
+void current_display_handler(uint16_t);
+
+/* Channel scheduler ---------------------------------------------------------
+ *
+ * One conversion is a slot. A channel with period n is converted every n'th
+ * slot, first channel gets every slot not claimed by the others. Results
+ * go to the channel's consumer in ADC ISR context, tagged with the current
+ * range the conversion was started with or ADC_RANGE_SETTLING.
+ */
+#define ADC_REF_RANGE 0xFF // follow current range
+#define ADC_REFS_11 (_BV(REFS0) | _BV(REFS1))
+#define ADC_REFS_VCC _BV(REFS0)
+
+typedef struct {
+    uint8_t mux;        // MUX3..0 bits of ADMUX, ADC pin number
+    uint8_t reference;  // REFS bits of ADMUX or ADC_REF_RANGE
+    uint8_t period;     // slots between conversions, unused for first channel
+    void (*consumer)(uint16_t sample, uint8_t range);
+} adc_channel;
+
+void current_sample(uint16_t sample, uint8_t range);
+#ifdef REGULATOR
+void vout_sample(uint16_t sample, uint8_t range);
+#endif
+
+const adc_channel adc_channels_[] = {
+    { 0, ADC_REF_RANGE, 1, current_sample },
+#ifdef REGULATOR
+    // Same period as control loop, so vout sample is always as old. Output
+    // would fit 1.1V, but AREF is shared and takes ADC_SETTLE_DOWN
+    // conversions to come down from 5V, so vout follows the current range.
+    // On 5V range a count is 54mV instead of 12mV and CV dithers by that.
+    { 1, ADC_REF_RANGE, REG_DIVIDER, vout_sample },
+#endif
+};
+
+#define ADC_CHANNELS (sizeof(adc_channels_) / sizeof(adc_channels_[0]))
+
+uint8_t adc_due_[ADC_CHANNELS]; // slots until channel is due
+
+/* Sets ADMUX for a conversion of channel, returns range it is started with */
+uint8_t adc_select(uint8_t channel) {
+    uint8_t range = adc_range_;
+    uint8_t refs = adc_channels_[channel].reference;
+
+    if(refs == ADC_REF_RANGE) {
+        refs = range == ADC_RANGE_11 ? ADC_REFS_11 : ADC_REFS_VCC;
+    }
+    ADMUX = refs | adc_channels_[channel].mux;
+    return range;
+}
 
 void init_adc(void) {
     // 1.1V with external capacitor at AREF pin
-    // select ADC0
-    ADMUX |= _BV(REFS0) | _BV(REFS1);
+    adc_range_ = ADC_RANGE_11;
+    adc_select(0);
+    for(uint8_t channel = 0; channel < ADC_CHANNELS; channel++) {
+        adc_due_[channel] = channel;
+        // digital input buffers of analog pins ADC0..5
+        if(adc_channels_[channel].mux <= ADC5D) {
+            DIDR0 |= _BV(adc_channels_[channel].mux);
+        }
+    }
+
     // ADC-clk = 1MHz / 128 = 7812Hz
-    ADCSRA |= _BV(ADEN) | _BV(ADSC) | _BV(ADIE) |
+    ADCSRA |= _BV(ADEN) | _BV(ADIE) |
               _BV(ADPS0) | _BV(ADPS1) | _BV(ADPS2);
 
-    adc_reference = ADCREFINIT;
+    update_trip_limit();
+    filter_reset();
+    evq_timed_push(current_display_handler, 0, CURRENT_DISPLAY_MS, EVQ_NORMAL);
 
     ADCSRA |= _BV(ADSC); // start new conversion
 }
 
-/*
- * Gain = 13
- * Rsense = 0.22ohm
- * Vin = ADC * 1024 / Vref
- * current = Vin / Gain / Rsense
+/* Returns current in 1/2^FILTER_FRAC_BITS mA */
+uint16_t adc_to_current(uint16_t sample, uint8_t range) {
+    uint8_t shift = ADC_MA_SHIFT - FILTER_FRAC_BITS;
+    uint32_t scaled = sample * adc_ma_k_[range] + (1UL << (shift - 1));
+    return (uint16_t)(scaled >> shift);
+}
+
+#ifdef REGULATOR
+/* Returns voltage in 10mV */
+uint16_t adc_to_voltage(uint16_t sample, uint8_t range) {
+    uint32_t scaled = sample * adc_vout_k_[range] + (1UL << (ADC_MA_SHIFT - 1));
+    return (uint16_t)(scaled >> ADC_MA_SHIFT);
+}
+#endif
+
+/* Slow stream: filtered current at fixed rate for display */
+void current_display_handler(uint16_t null) {
+    uint16_t filtered = filter_output() + (1 << (FILTER_FRAC_BITS - 1));
+    display_current = filtered >> FILTER_FRAC_BITS;
+
+    if(output_mode_ == REG_MODE_CC) {
+        status_led_toggle(LED_CURRENT);
+    }
+
+    evq_timed_push(current_display_handler, 0, CURRENT_DISPLAY_MS, EVQ_NORMAL);
+}
+
+/* Pushed by control loop when CV/CC mode changes. Current LED blinks while
+ * in CC mode.
  */
-void current_handeler(uint16_t current) {
-    uint32_t scale = (uint32_t)current * adc_reference * 100 / 1024 / 13 / 22;
-    current = (uint16_t)scale;
+void output_mode_handler(uint16_t mode) {
+    output_mode_ = mode;
+    if(mode == REG_MODE_CV) {
+        status_led_off(LED_CURRENT);
+    }
+}
 
-    if(current > *get_current_limit()) {
-        limit_current();
-    } else {
-        set_voltage(*get_voltage());
+uint8_t output_mode(void) {
+    return output_mode_;
+}
+
+/* Fast stream: every current sample. Limiting itself is done by the control
+ * loop and range is selected in ADC ISR, here the sample is fed to the
+ * filter. Settling samples are only an upper bound, they go to telemetry
+ * with their tag but are kept out of the filter.
+ */
+void current_handeler(uint16_t sample) {
+    uint8_t range = sample >> SAMPLE_RANGE_SHIFT;
+    uint16_t current = adc_to_current(sample & SAMPLE_MASK, range);
+#ifdef TELEMETRY
+    telemetry_sample(current, range);
+#endif
+    if(range == ADC_RANGE_SETTLING) {
+        return;
     }
+    filter_push(current);
 
-    // TODO: tee fiksummin
-    // how often displayed current value is updated
-    // smaller value means faster update
-    static uint16_t display_update = 0;
+    current = (current + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+    last_current_ = current;
+#ifdef TRACE
+    trace_sample(current);
+#endif
+}
 
-    if(display_update % 1000 == 0 && current > *get_current_limit()) {
-        status_led_toggle(LED_CURRENT);
+/* Converts trip limit to ADC counts of both ranges. Result is the smallest
+ * sample for which adc_to_current() gives a current above the limit.
+ *
+ * Saturated 1.1V sample only says current is over ~384mA, so a limit past
+ * that full scale does not trip on 1.1V at all: autorange switches up on
+ * saturation and the next samples decide. On 5V range a saturated sample
+ * trips, there is no range above it.
+ */
+void update_trip_limit(void) {
+    uint32_t trip = (uint32_t)*get_current_limit() + TRIP_MARGIN_MA;
+    uint32_t scaled = ((trip + 1) << ADC_MA_SHIFT) - (1UL << (ADC_MA_SHIFT - 1));
+
+    for(uint8_t range = ADC_RANGE_11; range <= ADC_RANGE_VCC; range++) {
+        uint32_t k = adc_ma_k_[range];
+        uint32_t counts = (scaled + k - 1) / k;
+
+        if(counts > ADC_FULL_SCALE) {
+            counts = range == ADC_RANGE_11 ? ADC_NO_TRIP : ADC_FULL_SCALE;
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            adc_trip_limit_[range] = counts;
+        }
     }
+}
 
-    if(display_update > 5000) {
-        display_current = current;
-        display_update = 0;
+/* Picks range for next conversions from a settled sample */
+void autorange(uint16_t sample, uint8_t range) {
+    static uint16_t prev = 0;
+    static int16_t trend = 0;
+    static uint8_t prev_range = ADC_RANGE_SETTLING;
+
+    if(range == ADC_RANGE_SETTLING) {
+        // too early for a trend, but a saturated sample needs more range
+        if(sample >= ADC_FULL_SCALE) {
+            adc_range_ = ADC_RANGE_VCC;
+        }
+        prev_range = range;
+        return;
     }
 
-    display_update++;
+    if(range == prev_range) {
+        int16_t delta = ((int16_t)sample - (int16_t)prev) * (1 << TREND_SHIFT);
+        trend += (delta - trend) / (1 << TREND_SHIFT);
+    } else {
+        trend = 0;
+    }
+    prev = sample;
+    prev_range = range;
+
+    if(range == ADC_RANGE_11) {
+        int32_t predicted = sample +
+                            (int32_t)trend * ADC_LOOKAHEAD_UP / (1 << TREND_SHIFT);
+        if(sample >= ADC_FULL_SCALE || predicted >= ADC_UP_COUNTS) {
+            adc_range_ = ADC_RANGE_VCC;
+        }
+    } else {
+        int32_t predicted = sample +
+                            (int32_t)trend * ADC_LOOKAHEAD_DOWN / (1 << TREND_SHIFT);
+        if(sample < ADC_DOWN_COUNTS && predicted < ADC_DOWN_COUNTS) {
+            adc_range_ = ADC_RANGE_11;
+        }
+    }
+}
 
-    // select Vref of ADC
-    // 1.1V gives better resolution in lower currents (1mA)
-    // 5V reference gives resolution of 4mA
-    if(adc_reference < ADCREFVCC && current > 490) {
-        adc_reference = ADCREFVCC;
-        ADMUX &= ~(_BV(REFS1));
-    } else if ( adc_reference > ADCREF11  && current < 470) {
-        adc_reference = ADCREF11;
-        ADMUX |= _BV(REFS1);
+/* Overcurrent beyond the trip limit is handled here rather than through the
+ * event queue, so the output is cut within the same interrupt that
+ * delivered the sample. Control loop restores OCR1A once current is back
+ * under the trip limit.
+ *
+ * Settling sample is compared in 1.1V counts, which is its lower bound, so
+ * it never trips falsely. Above 1.1V range it saturates instead and the
+ * switch up brings a proper comparison within a few conversions.
+ * Control loop keeps the latest settled sample.
+ */
+void current_sample(uint16_t sample, uint8_t range) {
+    uint8_t trip_range = range == ADC_RANGE_SETTLING ? ADC_RANGE_11 : range;
+    uint8_t tripped = sample >= adc_trip_limit_[trip_range];
+    if(tripped) {
+        adc_trips_ += !adc_tripped_;
+        OCR1A = 0;
     }
+    adc_tripped_ = tripped;
 
+    if(range != ADC_RANGE_SETTLING) {
+        iout_sample_ = sample;
+        iout_range_ = range;
+    }
+    autorange(sample, range);
+    evq_push(current_handeler, sample | ((uint16_t)range << SAMPLE_RANGE_SHIFT),
+             EVQ_CRITICAL);
 }
 
-/* ADC finished, result in ADC register */
+#ifdef REGULATOR
+/* Voltage changes slowly, control loop keeps the latest settled sample */
+void vout_sample(uint16_t sample, uint8_t range) {
+    if(range != ADC_RANGE_SETTLING) {
+        vout_sample_ = sample;
+        vout_range_ = range;
+    }
+}
+#endif
+
+/* ADC finished, result in ADC register
+ *
+ * Result is delivered, then the next channel is picked and its conversion
+ * started. Results are tagged ADC_RANGE_SETTLING for a while after a change
+ * of reference.
+ */
 ISR(ADC_vect) {
-    static float adc_reference_prev = ADCREFINIT;
+    PROFILE_SCOPE(PROF_ADC);
+    static uint8_t channel = 0;  // channel of finished conversion
+    static uint8_t divider = 0;
+    static uint8_t range = ADC_RANGE_11;
+    static uint8_t refs_prev = ADC_REFS_11;
+    static uint8_t settle = 0;
+    uint16_t sample = ADC;
+    uint8_t refs = ADMUX & ADC_REFS_11;
+
+    if(refs != refs_prev) {
+        settle = refs == ADC_REFS_11 ? ADC_SETTLE_DOWN : ADC_SETTLE_UP;
+        refs_prev = refs;
+    }
+    if(settle > 0) {
+        settle--;
+        range = ADC_RANGE_SETTLING;
+    }
 
-    // if reference changes, discard result
-    if(adc_reference_prev == adc_reference) {
-        evq_push(current_handeler, ADC);
-    } else {
-        adc_reference_prev = adc_reference;
+    adc_channels_[channel].consumer(sample, range);
+
+    channel = 0;
+    for(uint8_t i = 1; i < ADC_CHANNELS; i++) {
+        if(adc_due_[i] > 0) {
+            adc_due_[i]--;
+        }
+        if(adc_due_[i] == 0 && channel == 0) {
+            channel = i;
+            adc_due_[i] = adc_channels_[i].period;
+        }
     }
+    range = adc_select(channel);
 
     ADCSRA |= _BV(ADSC); // start new conversion
+
+    // next conversion runs meanwhile
+    if(++divider >= REG_DIVIDER) {
+        divider = 0;
+        control_update();
+    }
 }
 
 uint16_t* get_current() {
@@ -150,45 +546,118 @@ uint16_t* get_current() {
 /* limits ------------------------------------------------------------------- */
 uint16_t current_limit; // mA
 
+/* Limit is read by control loop ISR */
 void set_current_limit(uint16_t limit) {
-    if(limit >= 10 && limit < 3000) {
+    if(limit < 10) {
+        limit = 10;
+    } else if(limit > 2999) {
+        limit = 2999;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
         current_limit = limit;
-    } else if (limit < 10) {
-        current_limit = 10;
-    } else {
-        current_limit = 2999;
     }
+    update_trip_limit();
 }
 
 uint16_t* get_current_limit(void) {
     return &current_limit;
 }
 
-void limit_current(void) {
-    // set PWM output => 0
-    OCR1A = 0;
-}
-
 /* EEPROM */
-uint16_t EEMEM eeprom_voltage = 125;
-uint16_t EEMEM eeprom_current_limit = 200;
 
-void save_eeprom_current_limit(uint16_t current) {
-    eeprom_update_word(&eeprom_current_limit, *get_current_limit());
-    blink_led(LED_CURRENT, 200);
-}
+/* Asynchronous writer
+ *
+ * Requests are programmed one byte per EE_READY interrupt, bytes which
+ * already hold the value are skipped. EE_READY fires as long as EEPROM is
+ * idle and EERIE is set, so EERIE is kept set only while requests wait.
+ */
+typedef struct {
+    uint16_t addr;
+    uint8_t data[EE_WRITE_MAX];
+    uint8_t len;
+    void (*done)(uint16_t);
+    uint16_t done_data;
+} ee_request;
+
+#define EE_QUEUE_LEN 4
+ee_request ee_queue_[EE_QUEUE_LEN];
+uint8_t ee_head_ = 0;
+uint8_t ee_requests_ = 0;
+uint8_t ee_byte_ = 0; // next byte of head request
+
+uint8_t ee_write(uint16_t addr, const void* data, uint8_t len,
+                 void (*done)(uint16_t), uint16_t done_data)
+{
+    if(len == 0 || len > EE_WRITE_MAX) {
+        return 0;
+    }
 
-void save_eeprom_voltage(uint16_t voltage) {
-    eeprom_update_word(&eeprom_voltage, *get_voltage());
-    blink_led(LED_VOLTAGE, 200);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ee_request *req = 0;
+
+        // replace data of a waiting request to the same bytes
+        for(uint8_t idx = 0; idx < ee_requests_; idx++) {
+            ee_request *pending = &ee_queue_[(ee_head_ + idx) % EE_QUEUE_LEN];
+            if(idx == 0 && ee_byte_ > 0) {
+                // already being programmed
+                continue;
+            }
+            if(pending->addr == addr && pending->len == len) {
+                req = pending;
+                break;
+            }
+        }
+
+        if(req == 0) {
+            if(ee_requests_ >= EE_QUEUE_LEN) {
+                // queue is full
+                return 0;
+            }
+            req = &ee_queue_[(ee_head_ + ee_requests_) % EE_QUEUE_LEN];
+            req->addr = addr;
+            req->len = len;
+            ee_requests_++;
+        }
+
+        for(uint8_t idx = 0; idx < len; idx++) {
+            req->data[idx] = ((const uint8_t*)data)[idx];
+        }
+        req->done = done;
+        req->done_data = done_data;
+
+        EECR |= _BV(EERIE);
+    }
+    return 1;
 }
 
-uint16_t read_eeprom_current_limit(void) {
-    return eeprom_read_word(&eeprom_current_limit);
-}
+ISR(EE_READY_vect) {
+    PROFILE_SCOPE(PROF_EEPROM);
+    ee_request *req = &ee_queue_[ee_head_];
+
+    while(ee_byte_ < req->len) {
+        uint8_t value = req->data[ee_byte_];
+        EEAR = req->addr + ee_byte_;
+        ee_byte_++;
+
+        EECR |= _BV(EERE);
+        if(EEDR != value) {
+            EEDR = value;
+            EECR |= _BV(EEMPE);
+            EECR |= _BV(EEPE);
+            return; // continue when this byte is programmed
+        }
+    }
 
-uint16_t read_eeprom_voltage(void) {
-    return eeprom_read_word(&eeprom_voltage);
+    // request done
+    if(req->done) {
+        evq_push(req->done, req->done_data, EVQ_NORMAL);
+    }
+    ee_byte_ = 0;
+    ee_head_ = (ee_head_ + 1) % EE_QUEUE_LEN;
+    if(--ee_requests_ == 0) {
+        EECR &= ~_BV(EERIE);
+    }
 }
 
 /* SPI ---------------------------------------------------------------------- */
@@ -196,7 +665,19 @@ uint16_t read_eeprom_voltage(void) {
 #define spi_begin() PORTC &= ~(_BV(PC5));
 #define spi_end() PORTC |= (_BV(PC5));
 
-volatile uint16_t spi_data_word;
+typedef struct {
+    uint8_t data[SPI_FRAME_MAX];
+    uint8_t len;
+    void (*done)(uint16_t);
+    uint16_t done_data;
+} spi_frame;
+
+/* Frames waiting for transmission, spi_head_ is the one on the wire */
+#define SPI_QUEUE_LEN 2
+spi_frame spi_queue_[SPI_QUEUE_LEN];
+uint8_t spi_head_;
+volatile uint8_t spi_frames_;
+volatile uint8_t spi_byte_; // next byte of head frame
 
 /* MOSI - PB3
  * SCK  - PB5
@@ -208,23 +689,223 @@ void init_spi(void) {
     DDRC |= _BV(DDC5);
     SPCR |= _BV(SPE) | _BV(SPIE) | _BV(MSTR) | _BV(CPOL) | _BV(DORD);
     SPSR |= _BV(SPI2X);
-    spi_data_word = 0;
+    spi_head_ = 0;
+    spi_frames_ = 0;
 }
 
-void spi_send_word(uint16_t word) {
-    loop_until_bit_is_clear(SPSR, SPIF);
+/* Starts transmission of head frame, interrupts must be disabled */
+void spi_start_frame(void) {
     spi_begin();
-    spi_data_word = word;
+    spi_byte_ = 1;
+    SPDR = spi_queue_[spi_head_].data[0];
+}
+
+uint8_t spi_send_frame(const uint8_t* data, uint8_t len,
+                       void (*done)(uint16_t), uint16_t done_data)
+{
+    if(len == 0 || len > SPI_FRAME_MAX) {
+        return 0;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if(spi_frames_ >= SPI_QUEUE_LEN) {
+            // queue is full
+            return 0;
+        }
+
+        spi_frame *frame = &spi_queue_[(spi_head_ + spi_frames_) % SPI_QUEUE_LEN];
+        for(uint8_t idx = 0; idx < len; idx++) {
+            frame->data[idx] = data[idx];
+        }
+        frame->len = len;
+        frame->done = done;
+        frame->done_data = done_data;
+
+        if(++spi_frames_ == 1) {
+            // bus is idle
+            spi_start_frame();
+        }
+    }
+    return 1;
+}
+
+uint8_t spi_send_word(uint16_t word) {
     // LSB first
-    SPDR = (0x00FF & spi_data_word);
+    uint8_t data[2] = { word & 0x00FF, word >> 8 };
+    return spi_send_frame(data, 2, 0, 0);
 }
 
 ISR(SPI_STC_vect) {
-    if (spi_data_word > 0) {
-        // there's still data, send MSB
-        SPDR = (spi_data_word >> 8);
-        spi_data_word = 0;
-    } else {
-        spi_end(); // done
+    PROFILE_SCOPE(PROF_SPI);
+    spi_frame *frame = &spi_queue_[spi_head_];
+
+    if(spi_byte_ < frame->len) {
+        // there's still data
+        SPDR = frame->data[spi_byte_++];
+        return;
+    }
+
+    spi_end(); // done, latch outputs
+    if(frame->done) {
+        evq_push(frame->done, frame->done_data, EVQ_NORMAL);
+    }
+
+    spi_head_ = (spi_head_ + 1) % SPI_QUEUE_LEN;
+    if(--spi_frames_ > 0) {
+        spi_start_frame();
     }
 }
+
+/* UART ---------------------------------------------------------------------- */
+#ifdef UART_BAUD
+
+#define BAUD UART_BAUD
+#include <util/setbaud.h>
+
+// TX ring buffer, size must be a power of two
+#define UART_TX_BUFMAX 64
+uint8_t uart_tx_buf_[UART_TX_BUFMAX];
+volatile uint8_t uart_tx_head_ = 0; // next free position
+volatile uint8_t uart_tx_tail_ = 0; // next byte to send
+
+/* RX line buffers form a ring, ISR fills them in place and the line
+ * handler reads them without copying. A line which does not fit in a
+ * buffer, or which starts while no buffer is free, is dropped whole.
+ */
+char uart_rx_line_[UART_RX_LINES][UART_RX_LINE_MAX];
+uint8_t uart_rx_head_ = 0;          // buffer being filled
+uint8_t uart_rx_len_ = 0;
+uint8_t uart_rx_drop_ = 0;          // discarding until end of line
+volatile uint8_t uart_rx_busy_ = 0; // bit per buffer held by line handler
+void (*uart_line_handler_)(uint16_t) = 0;
+
+void init_uart(void (*line_handler)(uint16_t)) {
+    UBRR0H = UBRRH_VALUE;
+    UBRR0L = UBRRL_VALUE;
+#if USE_2X
+    UCSR0A |= _BV(U2X0);
+#else
+    UCSR0A &= ~(_BV(U2X0));
+#endif
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); // 8N1
+    UCSR0B = _BV(TXEN0);
+
+    uart_line_handler_ = line_handler;
+    if(line_handler) {
+        UCSR0B |= _BV(RXEN0) | _BV(RXCIE0);
+    }
+}
+
+char* uart_line(uint8_t idx) {
+    return uart_rx_line_[idx];
+}
+
+void uart_line_done(uint8_t idx) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uart_rx_busy_ &= ~(1 << idx);
+    }
+}
+
+ISR(USART_RX_vect) {
+    PROFILE_SCOPE(PROF_UART_RX);
+    char c = UDR0;
+
+    if(c == '\r' || c == '\n') {
+        if(uart_rx_drop_) {
+            uart_rx_drop_ = 0;
+            uart_rx_len_ = 0;
+            return;
+        }
+        if(uart_rx_len_ == 0) {
+            // empty line or second half of CR LF
+            return;
+        }
+        uart_rx_line_[uart_rx_head_][uart_rx_len_] = '\0';
+        uart_rx_len_ = 0;
+        if(evq_push(uart_line_handler_, uart_rx_head_, EVQ_NORMAL)) {
+            uart_rx_busy_ |= 1 << uart_rx_head_;
+            uart_rx_head_ = (uart_rx_head_ + 1) % UART_RX_LINES;
+        }
+        return;
+    }
+
+    if(uart_rx_drop_) {
+        return;
+    }
+    if((uart_rx_busy_ & (1 << uart_rx_head_)) ||
+       uart_rx_len_ >= UART_RX_LINE_MAX - 1) {
+        // no free buffer or line too long, a truncated command could still
+        // parse so the whole line goes
+        uart_rx_drop_ = 1;
+        return;
+    }
+    uart_rx_line_[uart_rx_head_][uart_rx_len_++] = c;
+}
+
+uint8_t uart_write(const uint8_t* data, uint8_t len) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t used = (uart_tx_head_ - uart_tx_tail_) & (UART_TX_BUFMAX - 1);
+        if(len > UART_TX_BUFMAX - 1 - used) {
+            // drop rather than wait
+            return 0;
+        }
+
+        for(uint8_t idx = 0; idx < len; idx++) {
+            uart_tx_buf_[uart_tx_head_] = data[idx];
+            uart_tx_head_ = (uart_tx_head_ + 1) & (UART_TX_BUFMAX - 1);
+        }
+        UCSR0B |= _BV(UDRIE0);
+    }
+    return 1;
+}
+
+/* Data register empty, send next byte */
+ISR(USART_UDRE_vect) {
+    PROFILE_SCOPE(PROF_UART_TX);
+    if(uart_tx_tail_ == uart_tx_head_) {
+        UCSR0B &= ~(_BV(UDRIE0));
+        return;
+    }
+    UDR0 = uart_tx_buf_[uart_tx_tail_];
+    uart_tx_tail_ = (uart_tx_tail_ + 1) & (UART_TX_BUFMAX - 1);
+}
+
+#endif
+
+/* TIMER0 ---------------------------------------------------------------------
+ * free-running clock for instrumentation, only built when it is used
+ */
+#if defined(EVQ_STATS) || defined(PROFILE)
+
+volatile uint8_t timer0_overflows_;
+
+void init_cycle_timer(void) {
+    TCCR0A = 0; // normal mode
+#if CYCLE_TIMER_DIV == 8
+    TCCR0B = _BV(CS01);
+#elif CYCLE_TIMER_DIV == 64
+    TCCR0B = _BV(CS01) | _BV(CS00);
+#else
+#error "CYCLE_TIMER_DIV must be 8 or 64"
+#endif
+    TIMSK0 |= _BV(TOIE0);
+}
+
+uint16_t cycle_timer_now(void) {
+    uint8_t high, low;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        high = timer0_overflows_;
+        low = TCNT0;
+        if((TIFR0 & _BV(TOV0)) && low < 0x80) {
+            // overflowed after interrupts were disabled
+            high++;
+        }
+    }
+    return ((uint16_t)high << 8) | low;
+}
+
+ISR(TIMER0_OVF_vect) {
+    timer0_overflows_++;
+}
+
+#endif
@@ -11,31 +11,110 @@
 
 #include <inttypes.h>
 
+/* CPU clock, normally given by the build. Timing of UART, the cycle timer
+ * and the profiler derive from it.
+ */
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
 /* ADC  --------------------------------------------------------------------- */
+enum adc_range {
+    ADC_RANGE_11,       // 1.1V reference, 1mA resolution
+    ADC_RANGE_VCC,      // 5V reference, 4mA resolution
+    ADC_RANGE_SETTLING  // reference between the two after a switch
+};
+
 void init_adc();
 void current_handeler(uint16_t current);
 uint16_t* get_current();
 
 /* EEPROM ------------------------------------------------------------------- */
-void save_eeprom_current_limit(uint16_t current);
-void save_eeprom_voltage(uint16_t voltage);
-uint16_t read_eeprom_current_limit(void);
-uint16_t read_eeprom_voltage(void);
+#define EE_WRITE_MAX 8
+
+/* Queues write of len bytes to EEPROM address addr and returns immediately.
+ * done(done_data) is pushed to event queue when the bytes are programmed,
+ * done may be 0. A waiting request to the same address and length is
+ * updated instead of queueing a second write.
+ * Returns 1 on success and 0 if the queue is full
+ */
+uint8_t ee_write(uint16_t addr, const void* data, uint8_t len,
+                 void (*done)(uint16_t), uint16_t done_data);
+
 
 /* Voltage PWM  ------------------------------------------------------------- */
 void init_voltage_pwm(void);
 void set_voltage(uint16_t set_voltage);
 uint16_t* get_voltage();
 
+/* Output is enabled at startup, disabled output keeps PWM at zero which
+ * is the 1.25V minimum of the regulator
+ */
+void set_output(uint8_t enable);
+uint8_t output_enabled(void);
+
+/* Mode of the control loop, enum regulator_mode in regulator.h */
+uint8_t output_mode(void);
+
 /* limits */
 void set_current_limit(uint16_t limit);
 uint16_t* get_current_limit(void);
-void limit_current(void);
 
 /* SPI  ------------------------------------------------------------------------
  * used to communicate with two 74HC595 sift registers
+ *
+ * Frames are queued and sent from SPI ISR, RCK is pulsed after the last
+ * byte of each frame. Send functions return 1 if frame was queued and 0 if
+ * the queue is full.
  */
+#define SPI_FRAME_MAX 4
+
 void init_spi(void);
-void spi_send_word(uint16_t word);
+
+/* done(done_data) is pushed to event queue after the frame is latched,
+ * done may be 0
+ */
+uint8_t spi_send_frame(const uint8_t* data, uint8_t len,
+                       void (*done)(uint16_t), uint16_t done_data);
+uint8_t spi_send_word(uint16_t word);
+
+/* UART  -----------------------------------------------------------------------
+ * only built when UART_BAUD is defined, uses PD0 and PD1
+ */
+#ifdef UART_BAUD
+#define UART_RX_LINES 2
+#define UART_RX_LINE_MAX 32
+
+/* Received lines are passed to line_handler through the event queue with
+ * index of the line buffer as data. Handler reads the line with uart_line()
+ * and must release the buffer with uart_line_done(). Receiver is disabled if
+ * line_handler is 0. Lines longer than UART_RX_LINE_MAX - 1 characters are
+ * dropped.
+ */
+void init_uart(void (*line_handler)(uint16_t));
+char* uart_line(uint8_t idx);
+void uart_line_done(uint8_t idx);
+
+/* Queues all len bytes for transmission or none of them.
+ * Returns 1 on success and 0 if there is not enough space
+ */
+uint8_t uart_write(const uint8_t* data, uint8_t len);
+#endif
+
+/* TIMER0  ---------------------------------------------------------------------
+ * 16-bit free-running clock for instrumentation, CYCLE_TIMER_DIV CPU clocks
+ * per count. The profiler needs 1us resolution for ISR timing, at the cost
+ * of 8 times as many overflow interrupts.
+ */
+#ifndef CYCLE_TIMER_DIV
+#ifdef PROFILE
+#define CYCLE_TIMER_DIV 8
+#else
+#define CYCLE_TIMER_DIV 64
+#endif
+#endif
+
+void init_cycle_timer(void);
+uint16_t cycle_timer_now(void);
 
 #endif /* PERIPHERALS_H_ */
@@ -0,0 +1,164 @@
+/*
+ * profile.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "profile.h"
+#include "peripherals.h"
+#include "eventqueue.h"
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#ifdef PROFILE
+
+profile_stats profile_[PROF_SITES];
+
+const profile_stats* profile_get(uint8_t site) {
+    return &profile_[site];
+}
+
+/* Buckets are halved when one of them would overflow, which keeps the
+ * shape of the histogram on long runs.
+ */
+void profile_record(uint8_t site, uint16_t time) {
+    profile_stats *ps = &profile_[site];
+
+    uint8_t bucket = 0;
+    for(uint16_t t = time; t && bucket < PROFILE_BUCKETS - 1; t >>= 1) {
+        bucket++;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if(++ps->histogram[bucket] == UINT16_MAX) {
+            for(uint8_t idx = 0; idx < PROFILE_BUCKETS; idx++) {
+                ps->histogram[idx] >>= 1;
+            }
+        }
+        if(time > ps->max) {
+            ps->max = time;
+        }
+    }
+}
+
+void profile_scope_exit(profile_scope* scope) {
+    profile_record(scope->site, cycle_timer_now() - scope->start);
+}
+
+/* Display refresh ----------------------------------------------------------
+ * Period is measured between refreshes, the cycle timer wraps after 2^16
+ * counts so periods longer than that alias.
+ */
+uint16_t last_refresh_;
+uint8_t refresh_primed_ = 0;
+
+void profile_display_refresh(uint8_t period_ms) {
+    uint16_t now = cycle_timer_now();
+    uint16_t nominal = (uint16_t)(F_CPU / CYCLE_TIMER_DIV / 1000) * period_ms;
+
+    if(refresh_primed_) {
+        uint16_t period = now - last_refresh_;
+        profile_record(PROF_DISPLAY, period > nominal ? period - nominal
+                                                      : nominal - period);
+    }
+    last_refresh_ = now;
+    refresh_primed_ = 1;
+}
+
+void profile_reset(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t *bytes = (uint8_t*)profile_;
+        for(uint16_t idx = 0; idx < sizeof(profile_); idx++) {
+            bytes[idx] = 0;
+        }
+        refresh_primed_ = 0;
+    }
+}
+
+/* Report ------------------------------------------------------------------- */
+
+#ifdef UART_BAUD
+
+#define SITE_NAME_MAX 10
+const char site_names_[PROF_SITES][SITE_NAME_MAX] PROGMEM = {
+    "TIMER2", "CONTROL", "ADC", "PCINT0", "PCINT1", "PCINT2", "INT0", "INT1",
+    "SPI", "EEPROM", "UART_RX", "UART_TX", "PUSH", "POP", "TIMED",
+    "DISPATCH", "DISPLAY"
+};
+
+// fields of a line are name, max and the buckets
+#define DUMP_FIELDS (2 + PROFILE_BUCKETS)
+#define DUMP_FIELDS_PER_EVENT 6
+
+uint8_t dump_site_;
+uint8_t dump_field_;
+
+uint8_t append_number(char* buf, uint16_t value) {
+    char digits[5];
+    uint8_t ndigits = 0;
+    uint8_t len = 0;
+    do {
+        digits[ndigits++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    while(ndigits) {
+        buf[len++] = digits[--ndigits];
+    }
+    return len;
+}
+
+void profile_dump_handler(uint16_t null) {
+    char buf[SITE_NAME_MAX + DUMP_FIELDS_PER_EVENT * 6 + 1];
+    uint8_t len = 0;
+    uint8_t site = dump_site_, field = dump_field_;
+
+    profile_stats ps;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ps = profile_[site];
+    }
+
+    for(uint8_t count = 0; count < DUMP_FIELDS_PER_EVENT &&
+                           field < DUMP_FIELDS; count++, field++) {
+        if(field == 0) {
+            char c;
+            for(const char *p = site_names_[site]; (c = pgm_read_byte(p)); p++) {
+                buf[len++] = c;
+            }
+            continue;
+        }
+        buf[len++] = ',';
+        len += append_number(buf + len, field == 1 ? ps.max
+                                                   : ps.histogram[field - 2]);
+    }
+    if(field == DUMP_FIELDS) {
+        buf[len++] = '\n';
+    }
+
+    if(!uart_write((const uint8_t*)buf, len)) {
+        evq_timed_push(profile_dump_handler, 0, 2, EVQ_BACKGROUND);
+        return;
+    }
+
+    if(field == DUMP_FIELDS) {
+        field = 0;
+        site++;
+    }
+    dump_site_ = site;
+    dump_field_ = field;
+    if(site < PROF_SITES) {
+        evq_push(profile_dump_handler, 0, EVQ_BACKGROUND);
+    }
+}
+
+void profile_dump(void) {
+    dump_site_ = 0;
+    dump_field_ = 0;
+    evq_push(profile_dump_handler, 0, EVQ_BACKGROUND);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * profile.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <inttypes.h>
+#include "peripherals.h"
+
+/* Interrupt latency and event loop jitter profiler, built when PROFILE is
+ * defined. Requires UART_BAUD for the report.
+ *
+ * Sites are timed with cycle_timer_now(), so all times are counts of
+ * CYCLE_TIMER_DIV CPU clocks. ISR sites cover the whole handler and
+ * EVQ sites the body of an ATOMIC_BLOCK, both are time with interrupts
+ * disabled. Atomic sections run from ISRs are counted in the ISR too.
+ * PROF_DISPATCH is the run time of event callbacks, which is how late the
+ * event loop can be for the next event. PROF_DISPLAY is the deviation of
+ * display refresh periods from the nominal period.
+ *
+ * TIMER0 overflow is the profiler's own clock and is not profiled.
+ */
+typedef enum {
+    PROF_TIMER2,     // evq tick and timer wheel
+    PROF_CONTROL,    // control loop, inside PROF_ADC
+    PROF_ADC,
+    PROF_PCINT0,
+    PROF_PCINT1,
+    PROF_PCINT2,
+    PROF_INT0,
+    PROF_INT1,
+    PROF_SPI,
+    PROF_EEPROM,
+    PROF_UART_RX,
+    PROF_UART_TX,
+    PROF_EVQ_PUSH,   // evq_push and evq_push_merge
+    PROF_EVQ_POP,
+    PROF_EVQ_TIMED,  // evq_timed_push
+    PROF_DISPATCH,
+    PROF_DISPLAY,
+    PROF_SITES
+} profile_site;
+
+// bucket n counts times of [2^(n-1), 2^n) counts, last is open
+#ifndef PROFILE_BUCKETS
+#define PROFILE_BUCKETS 10
+#endif
+
+typedef struct {
+    uint16_t max;
+    uint16_t histogram[PROFILE_BUCKETS];
+} profile_stats;
+
+#ifdef PROFILE
+typedef struct {
+    uint8_t site;
+    uint16_t start;
+} profile_scope;
+
+void profile_scope_exit(profile_scope* scope);
+
+/* Times the rest of the enclosing block, early returns included */
+#define PROFILE_SCOPE(site)                                             \
+    profile_scope profile_scope_                                        \
+        __attribute__((cleanup(profile_scope_exit))) =                  \
+        { (site), cycle_timer_now() }
+
+void profile_record(uint8_t site, uint16_t time);
+
+/* Called on every display refresh, period_ms is the nominal period */
+void profile_display_refresh(uint8_t period_ms);
+
+const profile_stats* profile_get(uint8_t site);
+void profile_reset(void);
+
+#ifdef UART_BAUD
+/* Writes one line per site to UART: name, max and histogram buckets,
+ * comma separated. Output is paced through the event queue.
+ */
+void profile_dump(void);
+#endif
+#else
+#define PROFILE_SCOPE(site)
+#define profile_record(site, time)
+#define profile_display_refresh(period_ms)
+#endif
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,139 @@
+/*
+ * regulator.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "regulator.h"
+#include "filter.h"
+#include <inttypes.h>
+
+#define CV_INTEGRAL_MAX ((int32_t)REG_TRIM_MAX << REG_Q)
+#define CV_INTEGRAL_MIN (-((int32_t)REG_DUTY_MAX << REG_Q))
+#define CC_INTEGRAL_MAX ((int32_t)REG_DUTY_MAX << REG_CC_Q)
+
+int32_t cv_integral_ = 0;               // PWM counts << REG_Q
+int32_t cc_integral_ = CC_INTEGRAL_MAX; // PWM counts << REG_CC_Q
+int16_t duty_ = 0;
+uint8_t mode_ = REG_MODE_CV;
+
+int32_t clamp(int32_t value, int32_t low, int32_t high) {
+    if(value < low) {
+        return low;
+    }
+    if(value > high) {
+        return high;
+    }
+    return value;
+}
+
+void regulator_reset(uint16_t duty) {
+    cv_integral_ = 0;
+    cc_integral_ = CC_INTEGRAL_MAX;
+    duty_ = duty;
+    mode_ = REG_MODE_CV;
+}
+
+void regulator_overload(void) {
+    cc_integral_ = 0;
+    duty_ = 0;
+    mode_ = REG_MODE_CC;
+}
+
+uint8_t regulator_mode(void) {
+    return mode_;
+}
+
+/* Anti-windup: integrator of the loop in control is not updated in a step
+ * where output is held by saturation or rate limit in the direction its
+ * error pushes. The other loop keeps integrating, but its integrator is
+ * capped so that its output stays at most REG_TRACK_MARGIN above the
+ * command of the loop in control. It takes over once its own error has
+ * pulled it below. Capping against the command instead of the rate
+ * limited duty keeps it from taking over while output is still slewing.
+ * CC well under its limit can't take over from CV, otherwise a CV step up
+ * would find it below the new command and hand it the output. In control
+ * it stays, e.g. after a trip it resumes from where it was.
+ */
+uint16_t regulator_update(uint16_t setpoint, uint16_t voltage,
+                          uint16_t limit, uint16_t current) {
+    int16_t feedforward = (int16_t)setpoint - REG_VOLTAGE_OFFSET;
+
+#ifdef REGULATOR
+    int16_t cv_error = setpoint - voltage;
+    int32_t cv_integral = clamp(cv_integral_ + (int32_t)REG_KI * cv_error,
+                                CV_INTEGRAL_MIN, CV_INTEGRAL_MAX);
+    int16_t cv_out = feedforward +
+                     (((int32_t)REG_KP * cv_error + cv_integral) >> REG_Q);
+#else
+    int16_t cv_error = 0;
+    int32_t cv_integral = 0;
+    int16_t cv_out = feedforward;
+#endif
+
+    int32_t cc_error = ((int32_t)limit << FILTER_FRAC_BITS) - current;
+    int32_t cc_integral = clamp(cc_integral_ + REG_CC_KI * cc_error,
+                                0, CC_INTEGRAL_MAX);
+    int16_t cc_out = (REG_CC_KP * cc_error + cc_integral) >> REG_CC_Q;
+    uint8_t cc_idle = mode_ == REG_MODE_CV &&
+                      cc_error >= (int32_t)REG_CC_IDLE_MA << FILTER_FRAC_BITS;
+
+    int16_t command;
+    int8_t push; // direction the loop in control wants to go
+    if(cc_out < cv_out && !cc_idle) {
+        mode_ = REG_MODE_CC;
+        command = cc_out;
+        push = cc_error < 0 ? -1 : cc_error > 0;
+    } else {
+        mode_ = REG_MODE_CV;
+        command = cv_out;
+        push = cv_error < 0 ? -1 : cv_error > 0;
+    }
+
+    int16_t high = duty_ + REG_SLEW_MAX;
+    int16_t low = duty_ - REG_SLEW_MAX;
+    if(high > REG_DUTY_MAX) {
+        high = REG_DUTY_MAX;
+    }
+    if(low < 0) {
+        low = 0;
+    }
+
+    int16_t out = command;
+    uint8_t hold = 0;
+    if(out > high) {
+        out = high;
+        hold = push > 0;
+    } else if(out < low) {
+        out = low;
+        hold = push < 0;
+    }
+
+    if(mode_ == REG_MODE_CC) {
+        if(!hold) {
+            cc_integral_ = cc_integral;
+        }
+#ifdef REGULATOR
+        // proportional term under the setpoint is left out, cancelling it
+        // would undercut CC by as much when voltage recovers fast
+        int16_t over = cv_error < 0 ? cv_error : 0;
+        int32_t track = (int32_t)(command + REG_TRACK_MARGIN - feedforward) *
+                        (1 << REG_Q) - (int32_t)REG_KP * over;
+        cv_integral_ = clamp(cv_integral, CV_INTEGRAL_MIN, track);
+#endif
+    } else {
+        if(!hold) {
+            cv_integral_ = cv_integral;
+        }
+        int32_t track = (int32_t)(command + REG_TRACK_MARGIN) * (1 << REG_CC_Q) -
+                        REG_CC_KP * cc_error;
+        // idle CC follows the command at once, its integral would lag
+        cc_integral_ = cc_idle ? clamp(track, 0, CC_INTEGRAL_MAX) :
+                                 clamp(cc_integral, 0, track);
+    }
+
+    duty_ = out;
+    return out;
+}
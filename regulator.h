@@ -0,0 +1,103 @@
+/*
+ * regulator.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef REGULATOR_H_
+#define REGULATOR_H_
+
+#include <inttypes.h>
+
+/* CV/CC control of PWM duty
+ *
+ * Two fixed point PI loops run side by side and the lower output wins:
+ * CV holds output voltage at the setpoint and CC holds current at the
+ * limit. The loop not in control tracks the applied duty, so switching
+ * between modes is bumpless.
+ *
+ * CV uses open-loop duty (setpoint - REG_VOLTAGE_OFFSET) as feed-forward
+ * and its PI only trims the remaining error. Measured output voltage is
+ * needed for that, without REGULATOR defined CV is the feed-forward alone.
+ *
+ * Voltages are in 10mV, current in 1/2^FILTER_FRAC_BITS mA, limit in mA
+ * and output is OCR1A value.
+ */
+enum regulator_mode {
+    REG_MODE_CV,
+    REG_MODE_CC
+};
+
+/* Control rate is ADC conversion rate / REG_DIVIDER, about 1kHz at 8MHz */
+#ifndef REG_DIVIDER
+#define REG_DIVIDER 5
+#endif
+
+/* PWM count 0 gives the 1.25V minimum of the regulator */
+#define REG_VOLTAGE_OFFSET 125
+#define REG_DUTY_MAX 1000
+
+/* CV gains have REG_Q fraction bits, 1.0 is one PWM count per 10mV */
+#define REG_Q 8
+#ifndef REG_KP
+#define REG_KP 128 // 0.5
+#endif
+#ifndef REG_KI
+#define REG_KI 16  // 1/16 per update
+#endif
+
+/* CC gains have REG_CC_Q fraction bits, 1.0 is one PWM count per
+ * 1/2^FILTER_FRAC_BITS mA. Loop gain grows as load resistance falls,
+ * these are stable into a short circuit.
+ */
+#define REG_CC_Q 12
+#ifndef REG_CC_KP
+#define REG_CC_KP 8 // 1/32 count per mA
+#endif
+#ifndef REG_CC_KI
+#define REG_CC_KI 4 // 1/64 count per mA per update
+#endif
+
+/* Largest correction CV integrator may add on top of feed-forward, PWM
+ * counts. Keeps a broken voltage feedback from driving output to maximum.
+ */
+#define REG_TRIM_MAX 200
+
+/* Loop not in control tracks this many PWM counts above the applied duty,
+ * so noise alone does not flip the mode
+ */
+#define REG_TRACK_MARGIN 2
+
+/* CC can't take over from CV while current is this many mA under the
+ * limit, so a step up of the CV command is not ramped at CC integral rate.
+ * Above noise and ripple of CC regulation.
+ */
+#define REG_CC_IDLE_MA 8
+
+/* Largest change of output per update, PWM counts */
+#define REG_SLEW_MAX 20
+
+/* Trip which comes within this many updates of resuming from the previous
+ * one restarts CC from zero duty
+ */
+#define REG_RETRIP_STEPS 20
+
+/* Clears integrators and sets output the rate limiter starts from */
+void regulator_reset(uint16_t duty);
+
+/* Output was cut for overcurrent, CC takes over from zero duty */
+void regulator_overload(void);
+
+/**
+ * Runs one control step
+ * Returns new duty
+ */
+uint16_t regulator_update(uint16_t setpoint, uint16_t voltage,
+                          uint16_t limit, uint16_t current);
+
+/* Loop in control after the latest update */
+uint8_t regulator_mode(void);
+
+#endif /* REGULATOR_H_ */
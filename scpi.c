@@ -0,0 +1,333 @@
+/*
+ * scpi.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "scpi.h"
+#include "peripherals.h"
+#include "eventqueue.h"
+#include "trace.h"
+#include "regulator.h"
+#include "profile.h"
+#include <inttypes.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#ifdef SCPI
+
+enum scpi_error {
+    SCPI_NO_ERROR = 0,
+    SCPI_DATA_TYPE_ERROR = -104,
+    SCPI_UNDEFINED_HEADER = -113,
+    SCPI_MISSING_PARAMETER = -109,
+    SCPI_DATA_OUT_OF_RANGE = -222
+};
+
+int16_t scpi_error_ = SCPI_NO_ERROR;
+
+/* Output --------------------------------------------------------------------
+ * Replies are built in a small buffer and queued to UART as a whole
+ */
+#define REPLY_MAX 40
+
+void reply(const char* text) {
+    char buf[REPLY_MAX];
+    uint8_t len = 0;
+    while(*text && len < REPLY_MAX - 1) {
+        buf[len++] = *text++;
+    }
+    buf[len++] = '\n';
+    uart_write((const uint8_t*)buf, len);
+}
+
+/* Formats value / 10^decimals, e.g. (525, 2) => "5.25", backwards so that
+ * the text ends just before end. Returns start of the text.
+ */
+char* format_fixed(char* end, uint16_t value, uint8_t decimals) {
+    char *p = end;
+    for(uint8_t digit = 0; digit <= decimals || value; digit++) {
+        if(digit == decimals && decimals) {
+            *--p = '.';
+        }
+        *--p = '0' + value % 10;
+        value /= 10;
+    }
+    return p;
+}
+
+void reply_fixed(uint16_t value, uint8_t decimals) {
+    char buf[8];
+    buf[sizeof(buf) - 1] = '\0';
+    reply(format_fixed(buf + sizeof(buf) - 1, value, decimals));
+}
+
+/* Parsing -------------------------------------------------------------------
+ * Line is tokenized in place: header is upper-cased and terminated at the
+ * first space, argument is the rest of the line.
+ */
+
+/* Parses decimal number into value * 10^decimals, extra fraction digits are
+ * ignored. Returns 1 on success.
+ */
+uint8_t parse_fixed(const char* arg, uint8_t decimals, uint16_t* result) {
+    uint32_t value = 0;
+    uint8_t fraction = 0;   // fraction digits taken
+    uint8_t in_fraction = 0;
+    uint8_t digits = 0;
+
+    for(; *arg; arg++) {
+        if(*arg == '.' && !in_fraction) {
+            in_fraction = 1;
+        } else if(*arg >= '0' && *arg <= '9') {
+            digits++;
+            if(in_fraction) {
+                if(fraction == decimals) {
+                    continue;
+                }
+                fraction++;
+            }
+            value = value * 10 + (*arg - '0');
+            if(value > UINT16_MAX) {
+                return 0;
+            }
+        } else {
+            return 0;
+        }
+    }
+
+    for(; fraction < decimals; fraction++) {
+        value *= 10;
+    }
+    if(digits == 0 || value > UINT16_MAX) {
+        return 0;
+    }
+    *result = value;
+    return 1;
+}
+
+/* Commands ------------------------------------------------------------------ */
+
+void cmd_idn(char* arg) {
+    reply("tuopppi,adjustable-power-supply,0,1");
+}
+
+void cmd_volt(char* arg) {
+    uint16_t value;
+    if(!parse_fixed(arg, 2, &value)) {
+        scpi_error_ = SCPI_DATA_TYPE_ERROR;
+        return;
+    }
+    set_voltage(value);
+    if(*get_voltage() != value) {
+        // clamped to supported range
+        scpi_error_ = SCPI_DATA_OUT_OF_RANGE;
+    }
+}
+
+void cmd_volt_query(char* arg) {
+    reply_fixed(*get_voltage(), 2);
+}
+
+void cmd_curr(char* arg) {
+    uint16_t value;
+    if(!parse_fixed(arg, 3, &value)) {
+        scpi_error_ = SCPI_DATA_TYPE_ERROR;
+        return;
+    }
+    set_current_limit(value);
+    if(*get_current_limit() != value) {
+        scpi_error_ = SCPI_DATA_OUT_OF_RANGE;
+    }
+}
+
+void cmd_curr_query(char* arg) {
+    reply_fixed(*get_current_limit(), 3);
+}
+
+void cmd_meas_curr(char* arg) {
+    reply_fixed(*get_current(), 3);
+}
+
+void cmd_outp(char* arg) {
+    if(strcmp(arg, "ON") == 0 || strcmp(arg, "1") == 0) {
+        set_output(1);
+    } else if(strcmp(arg, "OFF") == 0 || strcmp(arg, "0") == 0) {
+        set_output(0);
+    } else {
+        scpi_error_ = SCPI_DATA_TYPE_ERROR;
+    }
+}
+
+void cmd_outp_query(char* arg) {
+    reply(output_enabled() ? "1" : "0");
+}
+
+void cmd_outp_mode_query(char* arg) {
+    reply(output_mode() == REG_MODE_CC ? "CC" : "CV");
+}
+
+void cmd_syst_err(char* arg) {
+    switch(scpi_error_) {
+    case SCPI_DATA_TYPE_ERROR:
+        reply("-104,\"Data type error\"");
+        break;
+    case SCPI_MISSING_PARAMETER:
+        reply("-109,\"Missing parameter\"");
+        break;
+    case SCPI_UNDEFINED_HEADER:
+        reply("-113,\"Undefined header\"");
+        break;
+    case SCPI_DATA_OUT_OF_RANGE:
+        reply("-222,\"Data out of range\"");
+        break;
+    default:
+        reply("0,\"No error\"");
+    }
+    scpi_error_ = SCPI_NO_ERROR;
+}
+
+#ifdef EVQ_STATS
+/* Queue high-water marks and push failures per priority, then timer wheel
+ * high-water mark and failures
+ */
+void cmd_syst_stat(char* arg) {
+    const evq_stats *stats = evq_get_stats();
+    uint16_t fields[2 * EVQ_PRIORITIES + 2];
+    uint8_t count = 0;
+
+    for(uint8_t prio = 0; prio < EVQ_PRIORITIES; prio++) {
+        fields[count++] = stats->high_water[prio];
+    }
+    for(uint8_t prio = 0; prio < EVQ_PRIORITIES; prio++) {
+        fields[count++] = stats->push_failures[prio];
+    }
+    fields[count++] = stats->timers_high_water;
+    fields[count++] = stats->timer_failures;
+
+    char buf[REPLY_MAX];
+    char *p = buf + sizeof(buf) - 1;
+    *p = '\0';
+    while(count--) {
+        p = format_fixed(p, fields[count], 0);
+        if(count) {
+            *--p = ',';
+        }
+    }
+    reply(p);
+}
+#endif
+
+#ifdef PROFILE
+void cmd_syst_prof(char* arg) {
+    profile_dump();
+}
+
+void cmd_syst_prof_reset(char* arg) {
+    profile_reset();
+}
+#endif
+
+#ifdef TRACE
+void cmd_trac_arm(char* arg) {
+    trace_arm();
+}
+
+/* State (0 armed, 1 triggered, 2 stopped) and samples after trigger */
+void cmd_trac_stat(char* arg) {
+    char buf[REPLY_MAX];
+    char *p = buf + sizeof(buf) - 1;
+    *p = '\0';
+    p = format_fixed(p, trace_post_samples(), 0);
+    *--p = ',';
+    p = format_fixed(p, trace_get_state(), 0);
+    reply(p);
+}
+
+void cmd_trac_data(char* arg) {
+    trace_dump();
+}
+#endif
+
+/* Static dispatch table in flash, has_arg tells if command takes a value */
+typedef struct {
+    char header[14];
+    uint8_t has_arg;
+    void (*handler)(char* arg);
+} scpi_command;
+
+const scpi_command commands[] PROGMEM = {
+    { "*IDN?",      0, cmd_idn },
+    { "VOLT",       1, cmd_volt },
+    { "VOLT?",      0, cmd_volt_query },
+    { "CURR",       1, cmd_curr },
+    { "CURR?",      0, cmd_curr_query },
+    { "MEAS:CURR?", 0, cmd_meas_curr },
+    { "OUTP",       1, cmd_outp },
+    { "OUTP?",      0, cmd_outp_query },
+    { "OUTP:MODE?", 0, cmd_outp_mode_query },
+    { "SYST:ERR?",  0, cmd_syst_err },
+#ifdef EVQ_STATS
+    { "SYST:STAT?", 0, cmd_syst_stat },
+#endif
+#ifdef PROFILE
+    { "SYST:PROF?",    0, cmd_syst_prof },
+    { "SYST:PROF:RES", 0, cmd_syst_prof_reset },
+#endif
+#ifdef TRACE
+    { "TRAC:ARM",   0, cmd_trac_arm },
+    { "TRAC:STAT?", 0, cmd_trac_stat },
+    { "TRAC:DATA?", 0, cmd_trac_data },
+#endif
+};
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+void scpi_line_handler(uint16_t line) {
+    char *header = uart_line(line);
+    char *arg = header;
+
+    // upper-case header and split off argument
+    while(*arg == ' ') {
+        header = ++arg;
+    }
+    for(; *arg && *arg != ' '; arg++) {
+        if(*arg >= 'a' && *arg <= 'z') {
+            *arg -= 'a' - 'A';
+        }
+    }
+    if(*arg) {
+        *arg++ = '\0';
+        while(*arg == ' ') {
+            arg++;
+        }
+        for(char *p = arg; *p; p++) {
+            if(*p >= 'a' && *p <= 'z') {
+                *p -= 'a' - 'A';
+            }
+        }
+    }
+
+    uint8_t idx;
+    for(idx = 0; idx < COMMANDS; idx++) {
+        if(strcmp_P(header, commands[idx].header) == 0) {
+            break;
+        }
+    }
+
+    if(idx == COMMANDS) {
+        scpi_error_ = SCPI_UNDEFINED_HEADER;
+    } else if(pgm_read_byte(&commands[idx].has_arg) && *arg == '\0') {
+        scpi_error_ = SCPI_MISSING_PARAMETER;
+    } else {
+        void (*handler)(char*) =
+            (void (*)(char*))pgm_read_word(&commands[idx].handler);
+        handler(arg);
+    }
+
+    uart_line_done(line);
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * scpi.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SCPI_H_
+#define SCPI_H_
+
+#include <inttypes.h>
+
+/* SCPI style remote control over UART, built when SCPI is defined.
+ * Requires UART_BAUD.
+ *
+ * Commands, one per line, case insensitive:
+ *   *IDN?               identification
+ *   VOLT <volts>        set output voltage, e.g. VOLT 5.25
+ *   VOLT?               voltage setpoint in volts
+ *   CURR <amps>         set current limit, e.g. CURR 0.5
+ *   CURR?               current limit in amps
+ *   MEAS:CURR?          measured (filtered) current in amps
+ *   OUTP ON|OFF|1|0     enable or disable output
+ *   OUTP?               1 if output is enabled
+ *   OUTP:MODE?          CV or CC, regulation mode of the output
+ *   SYST:ERR?           last error, cleared when read
+ *   SYST:STAT?          event queue statistics, with EVQ_STATS
+ *   SYST:PROF?          profiler report, one line per site, with PROFILE
+ *   SYST:PROF:RES       clear profiler data, with PROFILE
+ *   TRAC:ARM            clear current trace and start recording, with TRACE
+ *   TRAC:STAT?          trace state and samples after trigger, with TRACE
+ *   TRAC:DATA?          current trace in mA, oldest first, with TRACE
+ */
+
+#if defined(SCPI) && !defined(UART_BAUD)
+#error "SCPI requires UART_BAUD"
+#endif
+
+#ifdef SCPI
+/* Line handler for init_uart() */
+void scpi_line_handler(uint16_t line);
+#endif
+
+#endif /* SCPI_H_ */
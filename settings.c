@@ -0,0 +1,119 @@
+/*
+ * settings.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "settings.h"
+#include "peripherals.h"
+#include "display.h"
+#include "eventqueue.h"
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+/* Log-structured storage
+ *
+ * The whole EEPROM is a ring of fixed size records. Every save appends a
+ * record to the slot after the newest one, so writes are spread evenly over
+ * all cells instead of rewriting the same two words.
+ *
+ * Sequence number of a record is one more than that of the record before
+ * it. The newest record is the valid one whose next slot does not hold its
+ * successor. A record cut short by power loss fails the checksum and the
+ * one before it is used instead.
+ */
+typedef struct {
+    uint8_t seq;
+    uint16_t voltage;
+    uint16_t current_limit;
+    uint8_t crc;
+} settings_record;
+
+// slot numbers are kept in uint8_t
+#define SETTINGS_SLOTS ((E2END + 1) / sizeof(settings_record) < 255 ? \
+                        (E2END + 1) / sizeof(settings_record) : 255)
+
+uint8_t head_slot_;     // slot of newest record
+uint8_t head_seq_;
+uint8_t write_pending_ = 0;
+
+uint8_t record_crc(const settings_record* rec) {
+    const uint8_t *bytes = (const uint8_t*)rec;
+    uint8_t crc = 0xFF; // erased record does not pass
+    for(uint8_t idx = 0; idx < sizeof(settings_record) - 1; idx++) {
+        crc = _crc8_ccitt_update(crc, bytes[idx]);
+    }
+    return crc;
+}
+
+uint8_t read_record(uint8_t slot, settings_record* rec) {
+    eeprom_read_block(rec, (const void*)(slot * sizeof(settings_record)),
+                      sizeof(settings_record));
+    return rec->crc == record_crc(rec);
+}
+
+uint8_t init_settings(uint16_t* voltage, uint16_t* current_limit) {
+    settings_record rec, next;
+    uint8_t found = 0;
+    uint8_t valid = read_record(0, &rec);
+
+    for(uint8_t slot = 0; slot < SETTINGS_SLOTS; slot++) {
+        uint8_t next_slot = slot + 1 < SETTINGS_SLOTS ? slot + 1 : 0;
+        uint8_t next_valid = read_record(next_slot, &next);
+
+        if(valid && !(next_valid && next.seq == (uint8_t)(rec.seq + 1))) {
+            head_slot_ = slot;
+            head_seq_ = rec.seq;
+            *voltage = rec.voltage;
+            *current_limit = rec.current_limit;
+            found = 1;
+        }
+
+        rec = next;
+        valid = next_valid;
+    }
+
+    if(!found) {
+        // empty log, first record goes to slot 0
+        head_slot_ = SETTINGS_SLOTS - 1;
+        head_seq_ = 0xFF;
+        *voltage = SETTINGS_DEFAULT_VOLTAGE;
+        *current_limit = SETTINGS_DEFAULT_CURRENT_LIMIT;
+    }
+    return found;
+}
+
+void settings_written(uint16_t led) {
+    write_pending_ = 0;
+    blink_led(led, 200);
+}
+
+void save_settings(uint16_t led) {
+    uint8_t slot = head_slot_;
+    settings_record rec;
+    rec.seq = head_seq_;
+
+    if(!write_pending_) {
+        slot = slot + 1 < SETTINGS_SLOTS ? slot + 1 : 0;
+        rec.seq++;
+    }
+    // else the queued record is updated in place
+
+    rec.voltage = *get_voltage();
+    rec.current_limit = *get_current_limit();
+    rec.crc = record_crc(&rec);
+
+    if(ee_write(slot * sizeof(settings_record), &rec, sizeof(rec),
+                settings_written, led)) {
+        head_slot_ = slot;
+        head_seq_ = rec.seq;
+        write_pending_ = 1;
+    } else {
+        // writer is busy, retry later
+        evq_timed_push(save_settings, led, 100, EVQ_BACKGROUND);
+    }
+}
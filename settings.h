@@ -0,0 +1,30 @@
+/*
+ * settings.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+#include <inttypes.h>
+
+#define SETTINGS_DEFAULT_VOLTAGE 125
+#define SETTINGS_DEFAULT_CURRENT_LIMIT 200
+
+/**
+ * Finds newest valid settings record in EEPROM, this function should be
+ * called at program startup. Returns 1 if a record was found and 0 if
+ * defaults were used.
+ */
+uint8_t init_settings(uint16_t* voltage, uint16_t* current_limit);
+
+/**
+ * Appends current voltage and current limit as a new record. Given status
+ * led blinks when the record is written.
+ */
+void save_settings(uint16_t led);
+
+#endif /* SETTINGS_H_ */
@@ -0,0 +1,62 @@
+/*
+ * telemetry.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "telemetry.h"
+#include "peripherals.h"
+#include "eventqueue.h"
+#include "filter.h"
+#include <inttypes.h>
+#include <util/crc16.h>
+
+#ifdef TELEMETRY
+
+uint8_t telemetry_count_ = 0;
+uint8_t telemetry_seq_ = 0;
+uint16_t telemetry_dropped_ = 0;
+
+void put_word(uint8_t* dst, uint16_t word) {
+    dst[0] = word & 0x00FF;
+    dst[1] = word >> 8;
+}
+
+void telemetry_sample(uint16_t current, uint8_t range) {
+    if(++telemetry_count_ < TELEMETRY_DECIMATION) {
+        return;
+    }
+    telemetry_count_ = 0;
+
+    uint8_t frame[TELEMETRY_FRAME_LEN];
+    frame[0] = TELEMETRY_SYNC;
+    frame[1] = telemetry_seq_++;
+    put_word(&frame[2], evq_time());
+    put_word(&frame[4], *get_voltage());
+    put_word(&frame[6], current);
+    frame[8] = range != ADC_RANGE_11 ? TELEMETRY_FLAG_RANGE_VCC : 0;
+    if(range == ADC_RANGE_SETTLING) {
+        frame[8] |= TELEMETRY_FLAG_SETTLING;
+    }
+    if(current > (*get_current_limit() << FILTER_FRAC_BITS)) {
+        frame[8] |= TELEMETRY_FLAG_OVER_LIMIT;
+    }
+
+    uint8_t crc = 0xFF;
+    for(uint8_t idx = 1; idx < TELEMETRY_FRAME_LEN - 1; idx++) {
+        crc = _crc8_ccitt_update(crc, frame[idx]);
+    }
+    frame[TELEMETRY_FRAME_LEN - 1] = crc;
+
+    if(!uart_write(frame, TELEMETRY_FRAME_LEN)) {
+        telemetry_dropped_++;
+    }
+}
+
+uint16_t telemetry_dropped(void) {
+    return telemetry_dropped_;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * telemetry.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <inttypes.h>
+
+/* Streams measurement frames over UART, built when TELEMETRY is defined.
+ * Requires UART_BAUD.
+ *
+ * Frame, multi-byte fields little endian:
+ *   0  sync 0xA5
+ *   1  sequence number, increments per frame including dropped ones
+ *   2  timestamp, ms (uint16)
+ *   4  voltage setpoint, 10mV (uint16)
+ *   6  current, 1/2^FILTER_FRAC_BITS mA (uint16)
+ *   8  flags
+ *   9  CRC-8 (poly 0x07, init 0xFF) of bytes 1 - 8
+ */
+#define TELEMETRY_SYNC 0xA5
+#define TELEMETRY_FRAME_LEN 10
+
+#define TELEMETRY_FLAG_OVER_LIMIT 0x01 // current above limit
+#define TELEMETRY_FLAG_RANGE_VCC 0x02  // sample taken with 5V reference
+#define TELEMETRY_FLAG_SETTLING 0x04   // reference settling, current is upper bound
+
+/* One frame is sent per TELEMETRY_DECIMATION samples, 1 streams every
+ * sample. Baud rate has to carry TELEMETRY_FRAME_LEN * 10 bits per frame.
+ */
+#ifndef TELEMETRY_DECIMATION
+#define TELEMETRY_DECIMATION 16
+#endif
+
+#if defined(TELEMETRY) && !defined(UART_BAUD)
+#error "TELEMETRY requires UART_BAUD"
+#endif
+
+#ifdef TELEMETRY
+/* Feeds a current sample in 1/2^FILTER_FRAC_BITS mA, called for every
+ * ADC sample
+ */
+void telemetry_sample(uint16_t current, uint8_t range);
+
+/* Frames dropped because UART buffer was full */
+uint16_t telemetry_dropped(void);
+#endif
+
+#endif /* TELEMETRY_H_ */
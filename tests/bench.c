@@ -0,0 +1,295 @@
+/*
+ * bench.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "filter.h"
+#include "scpi.h"
+#include "trace.h"
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Host timings of the hot paths. Absolute numbers say little about the
+ * AVR, compare them between revisions built on the same machine.
+ */
+#define ROUNDS 1000000L
+
+void render_frame(uint16_t value);
+extern volatile uint8_t adc_range_;
+uint16_t adc_to_current(uint16_t sample, uint8_t range);
+extern uint8_t trace_head_, trace_blocks_;
+
+// Vref of the division chain adc_to_current() replaced, kept out of reach
+// of constant folding like the volatile it was. Host compilers turn the
+// constant divisions into multiplies, volatile divisors force real
+// divisions as a software divide on AVR does.
+volatile uint16_t old_vref_ = 5000;
+volatile uint16_t div_1024_ = 1024, div_13_ = 13, div_22_ = 22;
+
+void noop(uint16_t data) {
+}
+
+double now(void);
+
+// steady load current in mA with +-1 LSB of ADC noise, rounded as
+// current_handeler passes it to the trace
+#define TRACE_INPUTS 4096
+uint16_t trace_in_[TRACE_INPUTS];
+
+void noisy_currents(uint16_t counts, uint8_t range) {
+    for(uint16_t idx = 0; idx < TRACE_INPUTS; idx++) {
+        uint16_t current = adc_to_current(counts + rand() % 3 - 1, range);
+        trace_in_[idx] = (current + (1 << (FILTER_FRAC_BITS - 1))) >>
+                         FILTER_FRAC_BITS;
+    }
+}
+
+// push to callback times of critical events
+#define LATENCIES (ROUNDS / 10)
+double pushed_at_;
+float latency_[LATENCIES];
+
+void critical(uint16_t data) {
+    latency_[data] = now() - pushed_at_;
+}
+
+int by_value(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* One SCPI line as the target handles it: receive ISR per character,
+ * the line handler and the reply through the data register empty ISR
+ */
+void scpi_line(const char* line) {
+    for(; *line; line++) {
+        UDR0 = *line;
+        USART_RX_vect();
+    }
+    UDR0 = '\n';
+    USART_RX_vect();
+    evq_dispatch();
+    do {
+        USART_UDRE_vect();
+    } while(UCSR0B & _BV(UDRIE0));
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void report(const char* name, double seconds) {
+    printf("%-28s %8.1f ns/call %10.0f calls/s\n", name,
+           seconds * 1e9 / ROUNDS, ROUNDS / seconds);
+}
+
+int main(void) {
+    init_evq_timer();
+    init_adc();
+    shim_run_events();
+    double start;
+
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        evq_push(noop, round, EVQ_NORMAL);
+        evq_front();
+        evq_pop();
+    }
+    report("evq_push + evq_pop", now() - start);
+
+    // critical event pushed with the normal ring full is dispatched next,
+    // on the target the callback running at push time adds to its latency.
+    // Host preemption shows in the max, the 99.99th percentile is the
+    // figure to compare.
+    while(evq_push(noop, 0, EVQ_NORMAL)) {
+    }
+    long overtaken = 0;
+    for(long round = 0; round < LATENCIES; round++) {
+        pushed_at_ = now();
+        evq_push(critical, round, EVQ_CRITICAL);
+        overtaken += evq_front()->callback != critical;
+        evq_dispatch();
+    }
+    qsort(latency_, LATENCIES, sizeof(latency_[0]), by_value);
+    printf("%-28s %8.1f ns median %6.1f ns 99.99%% %8.1f ns max, "
+           "%ld overtaken\n", "critical latency, normal full",
+           latency_[LATENCIES / 2] * 1e9,
+           latency_[LATENCIES - LATENCIES / 10000] * 1e9,
+           latency_[LATENCIES - 1] * 1e9, overtaken);
+    shim_run_events();
+
+    // tick cost with the wheel kept at n timers spread over all levels,
+    // expired timers are pushed again within the timed loop
+    const uint8_t occupancy[] = { 1, 4, 16, 64, 128 };
+    for(uint8_t idx = 0; idx < sizeof(occupancy); idx++) {
+        uint8_t timers = occupancy[idx];
+        for(uint16_t t = 0; t < timers; t++) {
+            evq_timed_push(noop, t, 1 + t * 997 % 5000, EVQ_NORMAL);
+        }
+        start = now();
+        for(long round = 0; round < ROUNDS; round++) {
+            TIMER2_COMPA_vect();
+            event* ep;
+            while((ep = evq_front())) {
+                evq_timed_push(noop, ep->data, 1 + ep->data * 997 % 5000,
+                               EVQ_NORMAL);
+                evq_pop();
+            }
+        }
+        char name[40];
+        snprintf(name, sizeof(name), "evq_timer_tick, %u timers", timers);
+        report(name, now() - start);
+        for(uint16_t t = 0; t < timers; t++) {
+            evq_timed_cancel(noop, t);
+        }
+    }
+
+    // ADC ISR with a sample over the trip limit, an upper bound of the
+    // time from result to OCR1A cleared
+    set_current_limit(200);
+    const uint16_t trip_sample[] = { 900, 500 }; // 315mA, 1950mA
+    for(uint8_t range = ADC_RANGE_11; range <= ADC_RANGE_VCC; range++) {
+        adc_range_ = range;
+        ADC = trip_sample[range];
+        ADC_vect();
+        shim_run_events();
+        start = now();
+        for(long round = 0; round < ROUNDS; round++) {
+            ADC_vect();
+            evq_front();
+            evq_pop();
+        }
+        report(range == ADC_RANGE_11 ? "ADC_vect trip, 1.1V"
+                                     : "ADC_vect trip, 5V", now() - start);
+        shim_run_events();
+    }
+
+    volatile uint16_t sink;
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        sink = (uint32_t)(round & 0x3FF) * old_vref_ * 100 / 1024 / 13 / 22;
+    }
+    report("division chain (before)", now() - start);
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        sink = (uint32_t)(round & 0x3FF) * old_vref_ * 100 / div_1024_ /
+               div_13_ / div_22_;
+    }
+    report("division chain, divides", now() - start);
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        sink = adc_to_current(round & 0x3FF, round & 1);
+    }
+    report("adc_to_current", now() - start);
+    (void)sink;
+
+    // per sample, decimation every sample and the IIR every 4^bits'th
+    filter_reset();
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        filter_push((round * 7 & 0x3FF) << FILTER_FRAC_BITS);
+    }
+    report("filter_push", now() - start);
+
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        current_handeler(round & 0x3FF);
+    }
+    report("current_handeler", now() - start);
+
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        render_frame(round % 3000);
+    }
+    report("render_frame", now() - start);
+
+    // CPU work of the queued send of a display word: the call and a
+    // transfer complete ISR per byte. The former send spun in the main
+    // loop while a previous word was still on the wire, up to 8 bits *
+    // 2 clocks per byte at F_CPU / 2.
+    init_spi();
+    start = now();
+    for(long round = 0; round < ROUNDS; round++) {
+        spi_send_word(round);
+        SPI_STC_vect();
+        SPI_STC_vect();
+    }
+    report("spi_send_word + 2 ISRs", now() - start);
+    printf("%-28s %8u AVR cycles/word spun back to back before, 0 now\n",
+           "spi blocking wait", 2 * 8 * 2);
+
+    // trace of the noisy load: samples the ring holds when full against
+    // the raw uint16_t samples of the same bytes, and the cost per sample
+    set_current_limit(2999);
+    const uint16_t trace_counts[] = { 550, 460 }; // 200mA, 800mA
+    for(uint8_t range = ADC_RANGE_11; range <= ADC_RANGE_VCC; range++) {
+        noisy_currents(trace_counts[range], range);
+        trace_arm();
+        uint16_t held = 0;
+        for(;; held++) {
+            uint8_t head = trace_head_;
+            trace_sample(trace_in_[held % TRACE_INPUTS]);
+            if(trace_blocks_ == TRACE_BLOCKS && trace_head_ != head &&
+               trace_head_ == 0) {
+                // oldest block went
+                break;
+            }
+        }
+        printf("%-28s %8.2f x raw, %u samples in %u bytes\n",
+               range == ADC_RANGE_11 ? "trace ratio, 1.1V noise"
+                                     : "trace ratio, 5V noise",
+               held / (TRACE_BLOCKS * TRACE_BLOCK_SIZE / 2.0), held,
+               TRACE_BLOCKS * TRACE_BLOCK_SIZE);
+        start = now();
+        for(long round = 0; round < ROUNDS; round++) {
+            trace_sample(trace_in_[round % TRACE_INPUTS]);
+        }
+        report(range == ADC_RANGE_11 ? "trace_sample, 1.1V noise"
+                                     : "trace_sample, 5V noise", now() - start);
+    }
+
+    // SCPI lines end to end per command, mean and 99.99th percentile of
+    // single lines, host preemption is left out as above. A 38400 baud
+    // line of n characters takes (n + 1) * 260 us on the wire, which
+    // bounds commands/s on the target long before these.
+    init_uart(scpi_line_handler);
+    const char* lines[] = {
+        "*IDN?", "VOLT 5.25", "VOLT?", "CURR 1.2345", "CURR?", "MEAS:CURR?",
+        "OUTP ON", "OUTP:MODE?", "SYST:STAT?", "VOLT 99999999", "FOO:BAR?",
+        "SYST:ERR?"
+    };
+    float worst = 0;
+    const char* worst_line = lines[0];
+    for(uint8_t idx = 0; idx < sizeof(lines) / sizeof(lines[0]); idx++) {
+        double total = 0;
+        for(long round = 0; round < LATENCIES; round++) {
+            start = now();
+            scpi_line(lines[idx]);
+            latency_[round] = now() - start;
+            total += latency_[round];
+        }
+        qsort(latency_, LATENCIES, sizeof(latency_[0]), by_value);
+        float tail = latency_[LATENCIES - LATENCIES / 10000];
+        if(tail > worst) {
+            worst = tail;
+            worst_line = lines[idx];
+        }
+        printf("scpi %-23s %8.1f ns/line %10.0f lines/s %8.1f ns 99.99%%\n",
+               lines[idx], total * 1e9 / LATENCIES, LATENCIES / total,
+               tail * 1e9);
+    }
+    printf("%-28s %8.1f ns 99.99%%, %s\n", "scpi worst line", worst * 1e9,
+           worst_line);
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * avr/eeprom.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_AVR_EEPROM_H_
+#define SHIM_AVR_EEPROM_H_
+
+#include <stddef.h>
+
+/* Reads the EEPROM model in shim.c */
+void eeprom_read_block(void* dst, const void* src, size_t len);
+
+#endif /* SHIM_AVR_EEPROM_H_ */
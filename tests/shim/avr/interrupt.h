@@ -0,0 +1,20 @@
+/*
+ * avr/interrupt.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_AVR_INTERRUPT_H_
+#define SHIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+/* Interrupt handlers are plain functions, tests call them by vector name */
+#define ISR(vector) void vector(void)
+
+#define sei()
+#define cli()
+
+#endif /* SHIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,177 @@
+/*
+ * avr/io.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_AVR_IO_H_
+#define SHIM_AVR_IO_H_
+
+#include <stdint.h>
+
+/* ATmega328 registers used by the firmware as plain variables, defined in
+ * shim.c. Only bit numbers the firmware refers to are listed.
+ */
+#define _BV(bit) (1 << (bit))
+
+#define SHIM_REG8(name) extern volatile uint8_t name;
+#define SHIM_REG16(name) extern volatile uint16_t name;
+
+SHIM_REG8(PORTB) SHIM_REG8(PORTC) SHIM_REG8(PORTD)
+SHIM_REG8(PINB) SHIM_REG8(PINC) SHIM_REG8(PIND)
+SHIM_REG8(DDRB) SHIM_REG8(DDRC) SHIM_REG8(DDRD)
+SHIM_REG8(PCMSK0) SHIM_REG8(PCMSK1) SHIM_REG8(PCMSK2) SHIM_REG8(PCICR)
+SHIM_REG8(EICRA) SHIM_REG8(EIMSK)
+SHIM_REG8(TCCR0A) SHIM_REG8(TCCR0B) SHIM_REG8(TCNT0) SHIM_REG8(TIMSK0)
+SHIM_REG8(TIFR0) SHIM_REG8(OCR0A)
+SHIM_REG8(TCCR1A) SHIM_REG8(TCCR1B) SHIM_REG16(TCNT1) SHIM_REG16(OCR1A)
+SHIM_REG16(ICR1) SHIM_REG8(TIMSK1)
+SHIM_REG8(TCCR2A) SHIM_REG8(TCCR2B) SHIM_REG8(TCNT2) SHIM_REG8(OCR2A)
+SHIM_REG8(OCR2B) SHIM_REG8(TIMSK2) SHIM_REG8(TIFR2) SHIM_REG8(ASSR)
+SHIM_REG8(ADMUX) SHIM_REG8(ADCSRA) SHIM_REG8(ADCSRB) SHIM_REG16(ADC)
+SHIM_REG8(DIDR0)
+SHIM_REG8(SPCR) SHIM_REG8(SPSR) SHIM_REG8(SPDR)
+SHIM_REG8(EECR) SHIM_REG16(EEAR)
+SHIM_REG8(UCSR0A) SHIM_REG8(UCSR0B) SHIM_REG8(UCSR0C) SHIM_REG8(UDR0)
+SHIM_REG8(UBRR0H) SHIM_REG8(UBRR0L)
+SHIM_REG8(SREG) SHIM_REG8(SMCR) SHIM_REG8(MCUSR)
+
+/* EEDR is loaded from the EEPROM model when a read is started with EERE */
+volatile uint8_t* shim_eedr(void);
+#define EEDR (*shim_eedr())
+
+#define E2END 0x3FF
+
+// PORTB, PINB, DDRB
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PORTB6 6
+#define PORTB7 7
+#define PINB6 6
+#define PINB7 7
+#define DDB2 2
+#define DDB3 3
+#define DDB5 5
+
+// PORTC, PINC, DDRC
+#define PC4 4
+#define PC5 5
+#define PINC4 4
+#define DDC5 5
+
+// PORTD, PIND, DDRD
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD4 4
+#define PORTD5 5
+#define PORTD6 6
+#define PIND4 4
+#define PIND5 5
+#define PIND6 6
+
+// external and pin change interrupts
+#define PCINT7 7
+#define PCINT12 4
+#define PCINT20 4
+#define PCINT21 5
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define ISC01 1
+#define ISC11 3
+#define INT0 0
+#define INT1 1
+
+// TIMER0
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define TOIE0 0
+#define TOV0 0
+
+// TIMER1
+#define WGM11 1
+#define COM1A1 7
+#define CS10 0
+#define WGM12 3
+#define WGM13 4
+#define TOIE1 0
+
+// TIMER2
+#define WGM20 0
+#define WGM21 1
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define TOV2 0
+#define OCF2A 1
+
+// ADC
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define REFS0 6
+#define REFS1 7
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADSC 6
+#define ADEN 7
+#define ADC0D 0
+#define ADC1D 1
+#define ADC2D 2
+#define ADC3D 3
+#define ADC4D 4
+#define ADC5D 5
+
+// SPI
+#define SPI2X 0
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+#define SPIF 7
+
+// EEPROM
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+
+// USART0
+#define U2X0 1
+#define UCSZ00 1
+#define UCSZ01 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define RXCIE0 7
+
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit) do { } while(bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do { } while(bit_is_set(sfr, bit))
+
+#endif /* SHIM_AVR_IO_H_ */
@@ -0,0 +1,23 @@
+/*
+ * avr/pgmspace.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_AVR_PGMSPACE_H_
+#define SHIM_AVR_PGMSPACE_H_
+
+#include <string.h>
+
+/* Host has one address space. A word read keeps the type of the object,
+ * pointers stored in flash are wider than a word here.
+ */
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(addr))
+#define strcmp_P strcmp
+
+#endif /* SHIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,22 @@
+/*
+ * avr/sleep.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_AVR_SLEEP_H_
+#define SHIM_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE 0
+
+/* sleep_cpu() returns at once, shim_sleeps counts how often it was called */
+extern unsigned long shim_sleeps;
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() (shim_sleeps++)
+
+#endif /* SHIM_AVR_SLEEP_H_ */
@@ -0,0 +1,140 @@
+/*
+ * shim.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "shim.h"
+#include "eventqueue.h"
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+
+/* Registers ---------------------------------------------------------------- */
+
+#undef SHIM_REG8
+#undef SHIM_REG16
+#define SHIM_REG8(name) volatile uint8_t name;
+#define SHIM_REG16(name) volatile uint16_t name;
+
+SHIM_REG8(PORTB) SHIM_REG8(PORTC) SHIM_REG8(PORTD)
+SHIM_REG8(PINB) SHIM_REG8(PINC) SHIM_REG8(PIND)
+SHIM_REG8(DDRB) SHIM_REG8(DDRC) SHIM_REG8(DDRD)
+SHIM_REG8(PCMSK0) SHIM_REG8(PCMSK1) SHIM_REG8(PCMSK2) SHIM_REG8(PCICR)
+SHIM_REG8(EICRA) SHIM_REG8(EIMSK)
+SHIM_REG8(TCCR0A) SHIM_REG8(TCCR0B) SHIM_REG8(TCNT0) SHIM_REG8(TIMSK0)
+SHIM_REG8(TIFR0) SHIM_REG8(OCR0A)
+SHIM_REG8(TCCR1A) SHIM_REG8(TCCR1B) SHIM_REG16(TCNT1) SHIM_REG16(OCR1A)
+SHIM_REG16(ICR1) SHIM_REG8(TIMSK1)
+SHIM_REG8(TCCR2A) SHIM_REG8(TCCR2B) SHIM_REG8(TCNT2) SHIM_REG8(OCR2A)
+SHIM_REG8(OCR2B) SHIM_REG8(TIMSK2) SHIM_REG8(TIFR2) SHIM_REG8(ASSR)
+SHIM_REG8(ADMUX) SHIM_REG8(ADCSRA) SHIM_REG8(ADCSRB) SHIM_REG16(ADC)
+SHIM_REG8(DIDR0)
+SHIM_REG8(SPCR) SHIM_REG8(SPSR) SHIM_REG8(SPDR)
+SHIM_REG8(EECR) SHIM_REG16(EEAR)
+SHIM_REG8(UCSR0A) SHIM_REG8(UCSR0B) SHIM_REG8(UCSR0C) SHIM_REG8(UDR0)
+SHIM_REG8(UBRR0H) SHIM_REG8(UBRR0L)
+SHIM_REG8(SREG) SHIM_REG8(SMCR) SHIM_REG8(MCUSR)
+
+unsigned long shim_sleeps = 0;
+
+/* EEPROM ------------------------------------------------------------------- */
+
+uint8_t shim_eeprom[E2END + 1];
+uint16_t shim_eeprom_writes[E2END + 1];
+volatile uint8_t eedr_;
+
+volatile uint8_t* shim_eedr(void) {
+    if(EECR & _BV(EERE)) {
+        eedr_ = shim_eeprom[EEAR & E2END];
+        EECR &= ~_BV(EERE);
+    }
+    return &eedr_;
+}
+
+void eeprom_read_block(void* dst, const void* src, size_t len) {
+    uintptr_t addr = (uintptr_t)src;
+    for(size_t idx = 0; idx < len; idx++) {
+        ((uint8_t*)dst)[idx] = shim_eeprom[(addr + idx) & E2END];
+    }
+}
+
+void shim_eeprom_erase(void) {
+    for(uint16_t idx = 0; idx <= E2END; idx++) {
+        shim_eeprom[idx] = 0xFF;
+    }
+}
+
+uint16_t shim_eeprom_run(uint16_t max_bytes) {
+    uint16_t programmed = 0;
+
+    for(;;) {
+        if(EECR & _BV(EEPE)) {
+            if(programmed == max_bytes) {
+                break;
+            }
+            // EEMPE must have been set before EEPE
+            if(EECR & _BV(EEMPE)) {
+                shim_eeprom[EEAR & E2END] = eedr_;
+                shim_eeprom_writes[EEAR & E2END]++;
+                programmed++;
+            }
+            EECR &= ~(_BV(EEPE) | _BV(EEMPE));
+        }
+        if(!(EECR & _BV(EERIE)) || !EE_READY_vect) {
+            break;
+        }
+        EE_READY_vect();
+    }
+    return programmed;
+}
+
+/* TIMER2 ------------------------------------------------------------------- */
+
+uint32_t shim_timer2_isrs = 0;
+
+void shim_timer2_count(void) {
+    if(TCCR2A & _BV(WGM21)) {
+        // CTC, TCNT2 is cleared on the count after the match
+        if(TCNT2 == OCR2A) {
+            TCNT2 = 0;
+            TIFR2 |= _BV(OCF2A);
+        } else {
+            TCNT2++;
+        }
+    } else {
+        // the firmware clears flags by writing one, which sets the variable
+        TIFR2 &= ~_BV(OCF2A);
+        if(++TCNT2 == 0) {
+            TIFR2 |= _BV(TOV2);
+        }
+        if(TCNT2 == OCR2A) {
+            TIFR2 |= _BV(OCF2A);
+        }
+    }
+
+    if((TIFR2 & _BV(TOV2)) && (TIMSK2 & _BV(TOIE2))) {
+        TIFR2 &= ~_BV(TOV2);
+        shim_timer2_isrs++;
+        if(TIMER2_OVF_vect) {
+            TIMER2_OVF_vect();
+        }
+        TIFR2 &= ~_BV(OCF2A);
+    }
+    if((TIFR2 & _BV(OCF2A)) && (TIMSK2 & _BV(OCIE2A))) {
+        TIFR2 &= ~_BV(OCF2A);
+        shim_timer2_isrs++;
+        if(TIMER2_COMPA_vect) {
+            TIMER2_COMPA_vect();
+        }
+    }
+}
+
+/* Event queue -------------------------------------------------------------- */
+
+void shim_run_events(void) {
+    while(evq_front()) {
+        evq_dispatch();
+    }
+}
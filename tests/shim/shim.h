@@ -0,0 +1,68 @@
+/*
+ * shim.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_H_
+#define SHIM_H_
+
+#include <inttypes.h>
+#include <avr/io.h>
+
+/* Host side models of the peripherals which the firmware depends on for
+ * timing. Everything else is a plain register variable which tests set and
+ * inspect directly. Interrupts run only when a test calls the vector or
+ * advances a model.
+ *
+ * Vectors are weak so that tests link in builds where an interrupt is
+ * compiled out, such a vector is a null pointer.
+ */
+#define SHIM_VECTOR(vector) void vector(void) __attribute__((weak));
+
+SHIM_VECTOR(TIMER0_OVF_vect)
+SHIM_VECTOR(TIMER1_OVF_vect)
+SHIM_VECTOR(TIMER2_COMPA_vect)
+SHIM_VECTOR(TIMER2_OVF_vect)
+SHIM_VECTOR(ADC_vect)
+SHIM_VECTOR(EE_READY_vect)
+SHIM_VECTOR(SPI_STC_vect)
+SHIM_VECTOR(USART_RX_vect)
+SHIM_VECTOR(USART_UDRE_vect)
+SHIM_VECTOR(PCINT0_vect)
+SHIM_VECTOR(PCINT1_vect)
+SHIM_VECTOR(PCINT2_vect)
+SHIM_VECTOR(INT0_vect)
+SHIM_VECTOR(INT1_vect)
+
+/* EEPROM ------------------------------------------------------------------- */
+
+extern uint8_t shim_eeprom[E2END + 1];
+extern uint16_t shim_eeprom_writes[E2END + 1]; // programming cycles per cell
+
+void shim_eeprom_erase(void);
+
+/* Programs bytes started with EEPE and runs EE_READY_vect while EERIE is
+ * set. Stops after max_bytes programmed bytes, which models power loss in
+ * the middle of a write. Returns number of bytes programmed.
+ */
+uint16_t shim_eeprom_run(uint16_t max_bytes);
+
+/* TIMER2 ------------------------------------------------------------------- */
+
+extern uint32_t shim_timer2_isrs;
+
+/* Advances TIMER2 by one count and runs its pending interrupts. Models CTC
+ * mode with compare match A and normal mode with overflow and compare
+ * match A, which are the two modes the event queue uses.
+ */
+void shim_timer2_count(void);
+
+/* Event queue -------------------------------------------------------------- */
+
+/* Dispatches events until the queue is empty */
+void shim_run_events(void);
+
+#endif /* SHIM_H_ */
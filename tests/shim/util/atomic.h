@@ -0,0 +1,17 @@
+/*
+ * util/atomic.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_UTIL_ATOMIC_H_
+#define SHIM_UTIL_ATOMIC_H_
+
+/* Tests run interrupts between calls, never inside a block */
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for(int atomic_once_ = 1; atomic_once_; atomic_once_ = 0)
+
+#endif /* SHIM_UTIL_ATOMIC_H_ */
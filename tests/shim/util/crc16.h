@@ -0,0 +1,23 @@
+/*
+ * util/crc16.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_UTIL_CRC16_H_
+#define SHIM_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+/* Same polynomial as avr-libc, x^8 + x^2 + x + 1 */
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for(uint8_t bit = 0; bit < 8; bit++) {
+        crc = crc & 0x80 ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+    return crc;
+}
+
+#endif /* SHIM_UTIL_CRC16_H_ */
@@ -0,0 +1,17 @@
+/*
+ * util/setbaud.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef SHIM_UTIL_SETBAUD_H_
+#define SHIM_UTIL_SETBAUD_H_
+
+#define UBRR_VALUE ((F_CPU + 8UL * BAUD) / (16UL * BAUD) - 1UL)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define UBRRL_VALUE (UBRR_VALUE & 0xFF)
+#define USE_2X 0
+
+#endif /* SHIM_UTIL_SETBAUD_H_ */
@@ -0,0 +1,43 @@
+/*
+ * test.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+
+/* One test program per file, each check prints its location on failure
+ * and the program returns test_result() from main.
+ */
+static int test_checks_ = 0;
+static int test_failures_ = 0;
+
+#define CHECK(cond) do {                                                \
+        test_checks_++;                                                 \
+        if(!(cond)) {                                                   \
+            test_failures_++;                                           \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        }                                                               \
+    } while(0)
+
+#define CHECK_EQ(actual, expected) do {                                 \
+        long actual_ = (long)(actual), expected_ = (long)(expected);    \
+        test_checks_++;                                                 \
+        if(actual_ != expected_) {                                      \
+            test_failures_++;                                           \
+            printf("%s:%d: %s is %ld, expected %ld\n", __FILE__, __LINE__, \
+                   #actual, actual_, expected_);                        \
+        }                                                               \
+    } while(0)
+
+static inline int test_result(const char* name) {
+    printf("%s: %d checks, %d failed\n", name, test_checks_, test_failures_);
+    return test_failures_ != 0;
+}
+
+#endif /* TEST_H_ */
@@ -0,0 +1,167 @@
+/*
+ * test_autorange.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include <math.h>
+#include <stdlib.h>
+
+/* Range switching against a model of AREF: after a switch up AVCC drives
+ * it within a conversion, after a switch down the 100nF capacitor
+ * discharges towards 1.1V with a time constant of 3 conversions. Sense
+ * amplifier gives 2.86V/A.
+ */
+#define TAU_UP 0.05
+#define TAU_DOWN 3.0
+#define SAMPLES 80000
+
+// tagged conversions per switch, ADC_SETTLE_UP and _DOWN of peripherals.c
+#define SETTLE_UP 1
+#define SETTLE_DOWN 16
+
+double aref_ = 1.1;
+
+uint16_t convert(double ma) {
+    double counts = ma * 2.86 / 1000.0 / aref_ * 1024;
+    return counts > 1023 ? 1023 : counts + 0.5;
+}
+
+void step_aref(void) {
+    double target = (ADMUX & _BV(REFS1)) ? 1.1 : 5.0;
+    double tau = target < aref_ ? TAU_DOWN : TAU_UP;
+    aref_ = target + (aref_ - target) * exp(-1.0 / tau);
+}
+
+double to_ma(uint16_t counts, double vref) {
+    return counts * vref * 100000 / (1024 * 286);
+}
+
+enum { SLOW_RAMP, FAST_RAMP, STEPS, HOLD };
+
+/* Current in mA for sample n */
+double waveform(uint8_t kind, long n) {
+    switch(kind) {
+    case SLOW_RAMP: { // 0..1000mA and back in 8000 samples
+        long t = n % 8000;
+        return t < 4000 ? t * 0.25 : (8000 - t) * 0.25;
+    }
+    case FAST_RAMP: { // same in 800 samples
+        long t = n % 800;
+        return t < 400 ? t * 2.5 : (800 - t) * 2.5;
+    }
+    case STEPS:
+        return (n / 400) % 2 ? 800 : 100;
+    default:          // between the thresholds with a count of noise
+        return 320 + (rand() % 3 - 1) * 1.1;
+    }
+}
+
+typedef struct {
+    long lost;        // no sample delivered
+    long wrong;       // settled sample off the true current
+    long settling;    // samples tagged ADC_RANGE_SETTLING
+    long bad_bound;   // settling sample not bounding the true current
+    long clipped;     // settled sample saturated on 1.1V
+    long switches;
+} result;
+
+result run(uint8_t kind) {
+    result r = { 0, 0, 0, 0, 0, 0 };
+    int8_t prev_range = -1;
+
+    for(long n = 0; n < SAMPLES; n++) {
+        double ma = waveform(kind, n);
+        ADC = convert(ma);
+        ADC_vect();
+        step_aref();
+
+        uint16_t data = 0;
+        uint8_t got = 0;
+        event* e;
+        while((e = evq_front())) {
+            if(e->callback == current_handeler) {
+                data = e->data;
+                got = 1;
+            }
+            evq_pop();
+        }
+        if(!got) {
+            r.lost++;
+            continue;
+        }
+
+        uint8_t range = data >> 14;
+        uint16_t counts = data & 0x3FF;
+        if(range == ADC_RANGE_SETTLING) {
+            // upper bound with 5V, lower bound with 1.1V
+            r.settling++;
+            if(ma > to_ma(counts, 5.0) * 1.02 + 4.3 ||
+               (counts < 1023 && ma < to_ma(counts, 1.1) * 0.98 - 1)) {
+                r.bad_bound++;
+            }
+            continue;
+        }
+        if(range == ADC_RANGE_11 && counts >= 1023) {
+            r.clipped++;
+        } else {
+            // a count and a half plus 2% reference error
+            double vref = range == ADC_RANGE_11 ? 1.1 : 5.0;
+            double tol = to_ma(3, vref) / 2 + ma * 0.02;
+            if(fabs(to_ma(counts, vref) - ma) > tol) {
+                r.wrong++;
+            }
+        }
+        if(range != prev_range) {
+            if(prev_range >= 0) {
+                r.switches++;
+            }
+            prev_range = range;
+        }
+    }
+    return r;
+}
+
+int main(void) {
+    init_evq_timer();
+    set_current_limit(2999);
+    init_adc();
+    srand(1);
+
+    // ramps are switched ahead of saturation, twice per period
+    result r = run(SLOW_RAMP);
+    CHECK_EQ(r.lost, 0);
+    CHECK_EQ(r.wrong, 0);
+    CHECK_EQ(r.bad_bound, 0);
+    CHECK_EQ(r.clipped, 0);
+    CHECK_EQ(r.switches, 2 * SAMPLES / 8000);
+    CHECK_EQ(r.settling, r.switches / 2 * (SETTLE_UP + SETTLE_DOWN));
+
+    r = run(FAST_RAMP);
+    CHECK_EQ(r.lost, 0);
+    CHECK_EQ(r.wrong, 0);
+    CHECK_EQ(r.bad_bound, 0);
+    CHECK_EQ(r.clipped, 0);
+    CHECK_EQ(r.switches, 2 * SAMPLES / 800);
+
+    // a step can't be predicted, its saturated sample switches up at once
+    r = run(STEPS);
+    CHECK_EQ(r.lost, 0);
+    CHECK_EQ(r.wrong, 0);
+    CHECK_EQ(r.bad_bound, 0);
+    CHECK(r.clipped <= SAMPLES / 800);
+    CHECK(r.switches >= 2 * SAMPLES / 800 - 1);
+
+    // noise between the thresholds does not chatter
+    r = run(HOLD);
+    CHECK_EQ(r.wrong, 0);
+    CHECK(r.switches <= 1);
+
+    return test_result("test_autorange");
+}
@@ -0,0 +1,168 @@
+/*
+ * test_control.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "regulator.h"
+#include "filter.h"
+#include <avr/io.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* Control loop as ADC ISR runs it. Output follows OCR1A at once, 1.25V at
+ * duty 0 and 10mV per count, into a resistive load. Samples are the exact
+ * conversions of the reference each conversion was started with.
+ */
+#define TRIP_MARGIN_MA 100 // of peripherals.c
+#define VOUT_MUX 1
+
+extern volatile uint8_t adc_tripped_;
+uint16_t adc_to_current(uint16_t sample, uint8_t range);
+uint16_t adc_to_voltage(uint16_t sample, uint8_t range);
+
+double load_ohm_ = 1e6;
+double forced_ma_ = 0; // current read instead of the load's, if set
+
+double vout(void) {
+    return OCR1A + REG_VOLTAGE_OFFSET;
+}
+
+/* Smallest sample which converts to value or more */
+uint16_t counts_for(uint16_t (*convert)(uint16_t, uint8_t), uint32_t value,
+                    uint8_t range) {
+    for(uint16_t counts = 0; counts < 1023; counts++) {
+        if(convert(counts, range) >= value) {
+            return counts;
+        }
+    }
+    return 1023;
+}
+
+/* Runs n conversions, with the event loop between them if events */
+void run(uint16_t n, uint8_t events) {
+    for(uint16_t idx = 0; idx < n; idx++) {
+        uint8_t range = ADMUX & _BV(REFS1) ? ADC_RANGE_11 : ADC_RANGE_VCC;
+        if((ADMUX & 0x0F) == VOUT_MUX) {
+            ADC = counts_for(adc_to_voltage, vout(), range);
+        } else {
+            double ma = forced_ma_ ? forced_ma_ : vout() * 10 / load_ohm_;
+            ADC = counts_for(adc_to_current, ma * (1 << FILTER_FRAC_BITS),
+                             range);
+        }
+        ADC_vect();
+        if(events) {
+            shim_run_events();
+        }
+    }
+}
+
+void noop(uint16_t data) {
+}
+
+int main(void) {
+    init_evq_timer();
+    set_voltage(500);
+    set_current_limit(200);
+    init_adc();
+
+    // CV: duty slews to the setpoint at REG_SLEW_MAX, changing only on
+    // control steps, CC stays out of it
+    run(200, 1);
+    CHECK(abs(OCR1A - (500 - REG_VOLTAGE_OFFSET)) <= 1);
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+    set_voltage(700);
+    uint16_t last = OCR1A, changed_at = 0, changes = 0;
+    for(uint16_t idx = 1; idx <= 10 * REG_DIVIDER; idx++) {
+        run(1, 1);
+        if(OCR1A != last) {
+            CHECK_EQ(idx - changed_at, changes ? REG_DIVIDER : idx);
+            changed_at = idx;
+            changes++;
+            last = OCR1A;
+        }
+    }
+    CHECK_EQ(changes, 10);
+    CHECK_EQ(OCR1A, 700 - REG_VOLTAGE_OFFSET);
+    CHECK_EQ(regulator_mode(), REG_MODE_CV);
+    set_voltage(500);
+    run(200, 1);
+
+    // 20 ohm at 5V draws 250mA, CC holds the 200mA limit. Mode reaches
+    // output_mode() through the event loop.
+    load_ohm_ = 20;
+    run(5 * REG_DIVIDER, 0);
+    CHECK_EQ(regulator_mode(), REG_MODE_CC);
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+    shim_run_events();
+    CHECK_EQ(output_mode(), REG_MODE_CC);
+    run(10000, 1);
+    CHECK(fabs(vout() * 10 / load_ohm_ - 200) <= 1);
+    CHECK_EQ(adc_tripped_, 0);
+
+    // trip cuts the output on the sample itself, the loop is held while
+    // tripped and resumes from where it was, without dipping as voltage
+    // comes back
+    uint16_t held = OCR1A;
+    forced_ma_ = 200 + TRIP_MARGIN_MA + 20;
+    run(1, 1);
+    CHECK_EQ(adc_tripped_, 1);
+    CHECK_EQ(OCR1A, 0);
+    for(uint8_t idx = 0; idx < 10 * REG_DIVIDER; idx++) {
+        run(1, 1);
+        CHECK_EQ(OCR1A, 0);
+    }
+    CHECK_EQ(adc_tripped_, 1);
+    forced_ma_ = 0;
+    run(REG_DIVIDER, 1);
+    CHECK_EQ(adc_tripped_, 0);
+    for(uint8_t idx = 0; idx < 100; idx++) {
+        CHECK(OCR1A >= held - 1 && OCR1A <= held + REG_SLEW_MAX);
+        run(REG_DIVIDER, 1);
+    }
+    CHECK_EQ(output_mode(), REG_MODE_CC);
+
+    // disabled output drops duty and reports CV
+    set_output(0);
+    run(REG_DIVIDER, 1);
+    CHECK_EQ(OCR1A, 0);
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+    set_output(1);
+    run(2000, 1);
+    CHECK_EQ(output_mode(), REG_MODE_CC);
+
+    // tripping again soon after resuming is an overload, CC restarts from
+    // zero duty instead of resuming into the next trip
+    for(uint8_t trip = 0; trip < 2; trip++) {
+        forced_ma_ = 200 + TRIP_MARGIN_MA + 20;
+        run(2, 1); // one of them is current
+        CHECK_EQ(adc_tripped_, 1);
+        forced_ma_ = 0;
+        run(REG_DIVIDER, 1);
+    }
+    CHECK(OCR1A <= REG_SLEW_MAX);
+    CHECK_EQ(regulator_mode(), REG_MODE_CC);
+    run(10000, 1);
+    CHECK(fabs(vout() * 10 / load_ohm_ - 200) <= 1);
+
+    // load removed, CC raises the output until CV takes over at the
+    // setpoint. Mode change is reported once the normal ring has room.
+    load_ohm_ = 1e6;
+    while(evq_push(noop, 0, EVQ_NORMAL)) {
+    }
+    run(100 * REG_DIVIDER, 0);
+    CHECK(abs(OCR1A - (500 - REG_VOLTAGE_OFFSET)) <= 1);
+    CHECK_EQ(regulator_mode(), REG_MODE_CV);
+    shim_run_events();
+    CHECK_EQ(output_mode(), REG_MODE_CC);
+    run(REG_DIVIDER, 1);
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+
+    return test_result("test_control");
+}
@@ -0,0 +1,48 @@
+/*
+ * test_convert.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "peripherals.h"
+#include "filter.h"
+#include <math.h>
+
+/* Multiply-and-shift current conversion against the exact value and the
+ * division chain it replaced, over every sample of both ranges
+ */
+uint16_t adc_to_current(uint16_t sample, uint8_t range);
+
+// former current_handeler formula, Vref in mV
+uint16_t old_to_ma(uint16_t sample, uint16_t vref) {
+    return (uint32_t)sample * vref * 100 / 1024 / 13 / 22;
+}
+
+int main(void) {
+    const uint16_t vref[] = { 1100, 5000 };
+    const double lsb = 1.0 / (1 << FILTER_FRAC_BITS);
+
+    for(uint8_t range = ADC_RANGE_11; range <= ADC_RANGE_VCC; range++) {
+        double worst = 0, old_worst = 0;
+        uint16_t worse = 0;
+        for(uint16_t sample = 0; sample < 1024; sample++) {
+            double exact = sample * vref[range] * 100.0 / (1024 * 286);
+            double error = fabs(adc_to_current(sample, range) * lsb - exact);
+            double old_error = fabs(old_to_ma(sample, vref[range]) - exact);
+            worst = error > worst ? error : worst;
+            old_worst = old_error > old_worst ? old_error : old_worst;
+            worse += error > old_error;
+        }
+        // exact value rounded to nearest fraction bit, old one truncated
+        // up to a whole mA
+        CHECK(worst <= lsb / 2 + 0.01);
+        CHECK(old_worst > 0.9);
+        CHECK_EQ(worse, 0);
+        printf("range %u: error %.3f mA, old formula %.3f mA\n", range,
+               worst, old_worst);
+    }
+    return test_result("test_convert");
+}
@@ -0,0 +1,105 @@
+/*
+ * test_eeprom.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include <avr/io.h>
+
+/* Asynchronous EEPROM writer. Programming a byte takes ~3.3 ms on the
+ * target, the shim completes it only when the test says so, so a writer
+ * which waited for EEPE would hang here instead of returning.
+ */
+#define EE_QUEUE_LEN 4 // of peripherals.c
+
+uint16_t done_[8];
+uint8_t dones_;
+
+void done(uint16_t data) {
+    done_[dones_++] = data;
+}
+
+uint8_t ticks_;
+
+void tick(uint16_t null) {
+    ticks_++;
+}
+
+uint8_t programming(void) {
+    return (EECR & _BV(EEPE)) != 0;
+}
+
+int main(void) {
+    init_evq_timer();
+    shim_eeprom_erase();
+
+    // queueing returns at once and only enables EE_READY
+    CHECK(ee_write(0x10, "abcd", 4, done, 1));
+    CHECK(EECR & _BV(EERIE));
+    CHECK(!programming());
+
+    // one interrupt starts one byte and returns while it is programmed
+    EE_READY_vect();
+    CHECK(programming());
+
+    // meanwhile the event loop runs and more writes queue without waiting
+    evq_push(tick, 0, EVQ_NORMAL);
+    shim_run_events();
+    CHECK_EQ(ticks_, 1);
+    CHECK(ee_write(0x20, "efgh", 4, done, 2));
+    CHECK(programming());
+
+    // every later byte takes one interrupt, nothing else is programmed
+    uint8_t steps = 0;
+    while(EECR & _BV(EERIE)) {
+        CHECK_EQ(shim_eeprom_run(1), 1);
+        steps++;
+        CHECK(steps <= 8);
+        evq_push(tick, 0, EVQ_NORMAL);
+        shim_run_events();
+    }
+    CHECK_EQ(steps, 8);
+    CHECK_EQ(ticks_, 1 + 8);
+    CHECK_EQ(shim_eeprom[0x10], 'a');
+    CHECK_EQ(shim_eeprom[0x13], 'd');
+    CHECK_EQ(shim_eeprom[0x23], 'h');
+    CHECK_EQ(dones_, 2);
+    CHECK_EQ(done_[0], 1);
+    CHECK_EQ(done_[1], 2);
+
+    // unchanged bytes are not programmed, done still comes
+    dones_ = 0;
+    CHECK(ee_write(0x10, "abcd", 4, done, 3));
+    CHECK_EQ(shim_eeprom_run(100), 0);
+    shim_run_events();
+    CHECK_EQ(dones_, 1);
+    CHECK(!(EECR & _BV(EERIE)));
+
+    // waiting writes to the same bytes coalesce, last data wins
+    dones_ = 0;
+    CHECK(ee_write(0x30, "xx", 2, done, 4));
+    CHECK(ee_write(0x30, "yz", 2, done, 5));
+    CHECK_EQ(shim_eeprom_run(100), 2);
+    shim_run_events();
+    CHECK_EQ(shim_eeprom[0x30], 'y');
+    CHECK_EQ(shim_eeprom[0x31], 'z');
+    CHECK_EQ(dones_, 1);
+    CHECK_EQ(done_[0], 5);
+
+    // full queue refuses at once
+    for(uint8_t idx = 0; idx < EE_QUEUE_LEN; idx++) {
+        CHECK(ee_write(0x40 + idx * 8, "q", 1, 0, 0));
+    }
+    CHECK(!ee_write(0x80, "r", 1, 0, 0));
+    CHECK_EQ(shim_eeprom_run(100), EE_QUEUE_LEN);
+    CHECK(ee_write(0x80, "r", 1, 0, 0));
+    shim_eeprom_run(100);
+
+    return test_result("test_eeprom");
+}
@@ -0,0 +1,77 @@
+/*
+ * test_evq.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+
+uint16_t order_[16];
+uint8_t handled_ = 0;
+
+void handler(uint16_t data) {
+    order_[handled_++] = data;
+}
+
+void other_handler(uint16_t data) {
+}
+
+int main(void) {
+    init_evq_timer();
+
+    // events of one priority are handled in order of push
+    for(uint16_t idx = 0; idx < 4; idx++) {
+        CHECK_EQ(evq_push(handler, idx, EVQ_NORMAL), idx + 1);
+    }
+    shim_run_events();
+    CHECK_EQ(handled_, 4);
+    for(uint8_t idx = 0; idx < 4; idx++) {
+        CHECK_EQ(order_[idx], idx);
+    }
+
+    // higher priority is handled first whatever the order of push
+    handled_ = 0;
+    evq_push(handler, EVQ_BACKGROUND, EVQ_BACKGROUND);
+    evq_push(handler, EVQ_NORMAL, EVQ_NORMAL);
+    evq_push(handler, EVQ_CRITICAL, EVQ_CRITICAL);
+    shim_run_events();
+    CHECK_EQ(handled_, 3);
+    CHECK_EQ(order_[0], EVQ_CRITICAL);
+    CHECK_EQ(order_[1], EVQ_NORMAL);
+    CHECK_EQ(order_[2], EVQ_BACKGROUND);
+
+    // full ring refuses and keeps its events
+    for(uint8_t idx = 0; idx < EVQ_CRITICAL_BUFMAX; idx++) {
+        CHECK(evq_push(other_handler, idx, EVQ_CRITICAL));
+    }
+    CHECK_EQ(evq_push(other_handler, 0, EVQ_CRITICAL), 0);
+    CHECK_EQ(evq_front()->data, 0);
+    shim_run_events();
+    CHECK(evq_front() == 0);
+
+    // deltas merge into the latest merged event while it waits, but not
+    // into the front which may be running
+    handled_ = 0;
+    evq_push_merge(handler, 1, EVQ_NORMAL);
+    evq_push_merge(handler, 2, EVQ_NORMAL);
+    evq_push_merge(handler, 3, EVQ_NORMAL);
+    evq_push(other_handler, 0, EVQ_NORMAL);
+    evq_push_merge(handler, 4, EVQ_NORMAL);
+    shim_run_events();
+    CHECK_EQ(handled_, 2);
+    CHECK_EQ(order_[0], 1);
+    CHECK_EQ(order_[1], 9);
+
+    // TIMER2 compare match ticks the clock every OCR2A + 1 counts
+    uint16_t start = evq_time();
+    for(uint16_t count = 0; count < 9 * 100; count++) {
+        shim_timer2_count();
+    }
+    CHECK_EQ(evq_time() - start, 100);
+
+    return test_result("test_evq");
+}
@@ -0,0 +1,151 @@
+/*
+ * test_font.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "display.h"
+#include <inttypes.h>
+
+extern uint16_t frame_[2];
+extern volatile char show_dots;
+void render_frame(uint16_t value);
+
+/* Hand written table the font generator replaced */
+const uint16_t display_data[36][2] = {
+    { 0b0000000000111001, 0b0000000001011010 }, // xxx0
+    { 0b0000000000110001, 0b0000000000000000 }, // xxx1
+    { 0b0000000000101001, 0b0000000001110010 }, // xxx2
+    { 0b0000000000111001, 0b0000000000110010 }, // xxx3
+    { 0b0000000000110001, 0b0000000000101010 }, // xxx4
+    { 0b0000000000011001, 0b0000000000111010 }, // xxx5
+    { 0b0000000000011001, 0b0000000001111010 }, // xxx6
+    { 0b0000000000111001, 0b0000000000000000 }, // xxx7
+    { 0b0000000000111001, 0b0000000001111010 }, // xxx8
+    { 0b0000000000111001, 0b0000000000111010 }, // xxx9
+    { 0b0000001011000001, 0b0000001110000010 }, // xx0x
+    { 0b0000000000000000, 0b0000000110000010 }, // xx1x
+    { 0b0000000111000001, 0b0000001100000010 }, // xx2x
+    { 0b0000000110000001, 0b0000001110000010 }, // xx3x
+    { 0b0000001100000001, 0b0000000110000010 }, // xx4x
+    { 0b0000001110000001, 0b0000001010000010 }, // xx5x
+    { 0b0000001111000001, 0b0000001010000010 }, // xx6x
+    { 0b0000000000000000, 0b0000001110000010 }, // xx7x
+    { 0b0000001111000001, 0b0000001110000010 }, // xx8x
+    { 0b0000001110000001, 0b0000001110000010 }, // xx9x
+    { 0b0001110000000001, 0b0010110000000010 }, // x0xx
+    { 0b0001100000000001, 0b0000000000000000 }, // x1xx
+    { 0b0001010000000001, 0b0011100000000010 }, // x2xx
+    { 0b0001110000000001, 0b0001100000000010 }, // x3xx
+    { 0b0001100000000001, 0b0001010000000010 }, // x4xx
+    { 0b0000110000000001, 0b0001110000000010 }, // x5xx
+    { 0b0000110000000001, 0b0011110000000010 }, // x6xx
+    { 0b0001110000000001, 0b0000000000000000 }, // x7xx
+    { 0b0001110000000001, 0b0011110000000010 }, // x8xx
+    { 0b0001110000000001, 0b0001110000000010 }, // x9xx
+    { 0b0000000000000000, 0b0000000000000000 }, // xxxx
+    { 0b0110000000000001, 0b0000000000000000 }, // 1xxx
+    { 0b1100000000000001, 0b1000000000000010 }, // 2xxx
+    { 0b0000001011000001, 0b0000001111011010 }, // OL
+    { 0b0000000000000000, 0b0000000000000110 }, // DOTS
+    { 0b0000000011000001, 0b0011100011100010 }, // cur
+};
+
+#define OLD_OL 33
+#define OLD_DOTS 34
+#define OLD_CUR 35
+
+#define ONES 0
+#define TENS 10
+#define HUNDREDS 20
+#define COMMONS 0x00030003UL
+
+/* Both phases of an old row as one word, phase 1 in the high half */
+uint32_t pins(uint8_t row) {
+    return display_data[row][0] | (uint32_t)display_data[row][1] << 16;
+}
+
+/* Pins of segment a - g of a position, picked apart from old digits */
+uint32_t segment(uint8_t position, char seg) {
+    uint32_t d[10];
+    for(uint8_t digit = 0; digit < 10; digit++) {
+        d[digit] = pins(position + digit) & ~COMMONS;
+    }
+    switch(seg) {
+    case 'a': return d[7] & ~d[1];
+    case 'b': return d[1] & ~d[6];
+    case 'c': return d[1] & ~d[2];
+    case 'd': return d[9] & ~d[4] & ~(d[7] & ~d[1]);
+    case 'e': return d[8] & ~d[9];
+    case 'f': return d[9] & ~d[3];
+    default:  return d[8] & ~d[0];
+    }
+}
+
+/* Pins of a glyph given as its lit segments */
+uint32_t glyph(uint8_t position, const char* segs) {
+    uint32_t result = 0;
+    for(; *segs; segs++) {
+        result |= segment(position, *segs);
+    }
+    return result;
+}
+
+/* Frame as shifted out, common of a phase is enabled if it lights something */
+void check_frame(uint32_t expected) {
+    uint16_t phase0 = expected, phase1 = expected >> 16;
+    CHECK_EQ(frame_[0], phase0 ? phase0 | 0x01 : 0);
+    CHECK_EQ(frame_[1], phase1 ? phase1 | 0x02 : 0);
+}
+
+int main(void) {
+    // every number matches the old table, with and without dots
+    for(uint8_t dots = 0; dots < 2; dots++) {
+        show_dots = dots;
+        for(uint16_t value = 0; value < 3000; value++) {
+            render_frame(value);
+            uint32_t expected = pins(30 + value / 1000) |
+                                pins(HUNDREDS + value / 100 % 10) |
+                                pins(TENS + value / 10 % 10) |
+                                pins(ONES + value % 10);
+            if(dots) {
+                expected |= pins(OLD_DOTS);
+            }
+            check_frame(expected);
+        }
+    }
+    show_dots = 0;
+
+    render_frame(DISPLAY_CUR);
+    check_frame(pins(OLD_CUR));
+    render_frame(DISPLAY_OL);
+    check_frame(pins(OLD_OL));
+
+    // segments picked apart from digits spell the old strings
+    CHECK_EQ(glyph(HUNDREDS, "deg") | glyph(TENS, "cde") | glyph(ONES, "eg"),
+             pins(OLD_CUR) & ~COMMONS);
+    CHECK_EQ(glyph(TENS, "abcdef") | glyph(ONES, "def"),
+             pins(OLD_OL) & ~COMMONS);
+
+    // strings added with the generator
+    render_frame(DISPLAY_CC);
+    check_frame(glyph(TENS, "adef") | glyph(ONES, "adef"));
+    render_frame(DISPLAY_CV);
+    check_frame(glyph(TENS, "adef") | glyph(ONES, "bcdef"));
+    render_frame(DISPLAY_ERR);
+    check_frame(glyph(HUNDREDS, "adefg") | glyph(TENS, "eg") |
+                glyph(ONES, "eg"));
+    render_frame(DISPLAY_VOLTS);
+    check_frame(glyph(ONES, "bcdef"));
+    render_frame(DISPLAY_AMPS);
+    check_frame(glyph(ONES, "abcefg"));
+
+    // past the last string is blank
+    render_frame(DISPLAY_AMPS + 1);
+    check_frame(0);
+
+    return test_result("test_font");
+}
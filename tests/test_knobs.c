@@ -0,0 +1,96 @@
+/*
+ * test_knobs.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include <avr/io.h>
+
+/* Voltage knob spun at 10 detents per ms while the event loop is held by
+ * a 4 ms callback, with ADC samples and TIMER2 running meanwhile. Time
+ * steps are 4 us. Each burst alternates direction, which keeps every
+ * detent at gain one, and has one clockwise detent more, so the setpoint
+ * must end BURSTS * VOLTAGE_CHANGE_PER_NOTCH above where it started.
+ */
+#define BURSTS 50
+#define BURST_DETENTS 41
+#define DETENT_US 100
+#define BUSY_US 4000
+#define IDLE_US 60000   // over the 50 ms of knob acceleration
+#define TIMER2_US 128   // 1024 / F_CPU
+#define ADC_US 208      // 13 * 128 / F_CPU
+#define VOLTAGE_CHANGE_PER_NOTCH 5 // of controls.c
+
+void voltage_knob_handler(uint16_t notches);
+
+// former PCINT2 detent, one event per detent
+void unmerged_detent(void) {
+    evq_push(voltage_knob_handler, PINB & _BV(PINB6) ? -1 : 1, EVQ_NORMAL);
+}
+
+void spin(void (*detent)(void)) {
+    uint32_t t = 0;
+    for(uint8_t burst = 0; burst < BURSTS; burst++) {
+        uint16_t detents = 0;
+        for(uint32_t end = t + BUSY_US + IDLE_US; t < end; t += 4) {
+            if(t % TIMER2_US == 0) {
+                shim_timer2_count();
+            }
+            if(t % ADC_US == 0) {
+                ADC_vect();
+            }
+            if(t % DETENT_US == 0 && detents < BURST_DETENTS) {
+                // clockwise when B is low
+                if(detents++ % 2) {
+                    PINB |= _BV(PINB6);
+                } else {
+                    PINB &= ~_BV(PINB6);
+                }
+                detent();
+            }
+            // loop is busy for BUSY_US from the start of the burst
+            if(end - t < IDLE_US) {
+                shim_run_events();
+            }
+        }
+    }
+}
+
+int main(void) {
+    init_evq_timer();
+    set_current_limit(2999);
+    init_adc();
+    ADC = 100;
+    PIND = _BV(PIND4) | _BV(PIND5); // switch released, A high
+
+    // before: normal ring overflows and detents are lost
+    set_voltage(500);
+    evq_reset_stats();
+    spin(unmerged_detent);
+    const evq_stats* stats = evq_get_stats();
+    uint8_t before_high = stats->high_water[EVQ_NORMAL];
+    uint16_t before_dropped = stats->push_failures[EVQ_NORMAL];
+    CHECK(before_dropped > 0);
+
+    // after: detents of a burst merge into one pending event
+    set_voltage(500);
+    evq_reset_stats();
+    spin(PCINT2_vect);
+    CHECK(stats->high_water[EVQ_NORMAL] <= 4);
+    CHECK_EQ(stats->push_failures[EVQ_NORMAL], 0);
+    CHECK_EQ(stats->push_failures[EVQ_CRITICAL], 0);
+    CHECK_EQ(*get_voltage(), 500 + BURSTS * VOLTAGE_CHANGE_PER_NOTCH);
+
+    printf("normal ring, %u detents per burst: high water %u -> %u, "
+           "dropped %u -> %u\n", BURST_DETENTS, before_high,
+           stats->high_water[EVQ_NORMAL], before_dropped,
+           stats->push_failures[EVQ_NORMAL]);
+
+    return test_result("test_knobs");
+}
@@ -0,0 +1,168 @@
+/*
+ * test_regulator.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "regulator.h"
+#include "filter.h"
+#include <math.h>
+#include <stdlib.h>
+
+/* Output stage model, stepped once per ADC conversion, control update
+ * runs every REG_DIVIDER'th step as in ADC ISR. PWM is smoothed by an RC
+ * of 2 ms into the adjust pin, the regulator has 3% gain error, +80mV
+ * offset and 0.5 ohm output resistance, and the output capacitor follows
+ * with 0.5 ms. Voltages in 10mV.
+ */
+#define STEPS_PER_UPDATE REG_DIVIDER
+#define STEP_MS (1000.0 * 13 * 128 / F_CPU)
+#define FULL_SCALE_MA 1746 // ADC saturates, 5V range of peripherals.c
+#define CC_RIPPLE_MA 3.3   // peak to peak in CC mode
+
+double pwm_ = 0;         // smoothed duty
+double vout_ = 125;
+double load_ohm_ = 1e6;  // resistive load
+uint8_t feedback_ = 1;   // 0 cuts voltage feedback
+
+double current_ma(void) {
+    return vout_ * 10.0 / load_ohm_;
+}
+
+typedef struct {
+    double peak;
+    double settle_ms;   // last time output was outside the band
+    double final;
+    uint16_t duty;
+    double mean_ma;     // load current over the run
+    double ripple_ma;   // peak to peak of it
+} response;
+
+/* Runs the loop for ms and records how the output behaves relative to
+ * target, which is within band of it once settled
+ */
+response run(uint16_t setpoint, uint16_t limit, double ms, double target,
+             double band) {
+    response r = { 0, 0, 0, 0, 0, 0 };
+    uint16_t duty = 0;
+    long steps = ms / STEP_MS;
+    double low = 1e6, high = 0;
+
+    for(long step = 0; step < steps; step++) {
+        if(step % STEPS_PER_UPDATE == 0) {
+            // ADC noise of one count on both measurements
+            uint16_t measured = feedback_ ? vout_ + 0.5 + (rand() % 3 - 1) : 0;
+            double ma = current_ma() + (rand() % 3 - 1);
+            ma = ma < FULL_SCALE_MA ? ma : FULL_SCALE_MA;
+            uint16_t current = ma > 0 ? ma * (1 << FILTER_FRAC_BITS) : 0;
+            duty = regulator_update(setpoint, measured, limit, current);
+        }
+        pwm_ += (duty - pwm_) * (STEP_MS / 2.0);
+        double open = (pwm_ + REG_VOLTAGE_OFFSET) * 0.97 + 8;
+        double ohm = load_ohm_ + 0.5;
+        double v = open * load_ohm_ / ohm;
+        vout_ += (v - vout_) * (STEP_MS / 0.5);
+
+        if(vout_ > r.peak) {
+            r.peak = vout_;
+        }
+        if(fabs(vout_ - target) > band) {
+            r.settle_ms = step * STEP_MS;
+        }
+        double ma = current_ma();
+        r.mean_ma += ma / steps;
+        low = ma < low ? ma : low;
+        high = ma > high ? ma : high;
+    }
+    r.ripple_ma = high - low;
+    r.final = vout_;
+    r.duty = duty;
+    return r;
+}
+
+int main(void) {
+    srand(1);
+    regulator_reset(0);
+
+    // step from the 1.25V minimum to 5V settles within 1% and does not
+    // overshoot more than that
+    response r = run(500, 1500, 200, 500, 5);
+    CHECK(r.settle_ms < 40);
+    CHECK(r.peak < 505);
+    CHECK(fabs(r.final - 500) < 2);
+
+    // larger step is rate limited, but gets there
+    r = run(1000, 1500, 300, 1000, 10);
+    CHECK(r.settle_ms < 150);
+    CHECK(r.peak < 1010);
+    CHECK(fabs(r.final - 1000) < 3);
+
+    // 1A load is corrected to within 1% without leaving CV mode
+    run(500, 1500, 200, 500, 5);
+    load_ohm_ = 5.0;
+    r = run(500, 1500, 300, 500, 5);
+    CHECK(r.settle_ms < 100);
+    CHECK(fabs(r.final - 500) < 2);
+    CHECK_EQ(regulator_mode(), REG_MODE_CV);
+    load_ohm_ = 1e6;
+    run(500, 1500, 300, 500, 5);
+
+    // lost feedback reads as 0V, integrator adds at most REG_TRIM_MAX on
+    // top of feed-forward and the proportional term
+    feedback_ = 0;
+    r = run(500, 1500, 500, 500, 5);
+    CHECK_EQ(r.duty, 500 - REG_VOLTAGE_OFFSET + REG_TRIM_MAX +
+                     ((int32_t)REG_KP * 500 >> REG_Q));
+    feedback_ = 1;
+    r = run(500, 1500, 300, 500, 5);
+    CHECK(fabs(r.final - 500) < 2);
+
+    // 2 ohm at 5V would draw 2.5A, CC holds it at the 1A limit
+    run(500, 1500, 300, 500, 5);
+    load_ohm_ = 2.0;
+    r = run(500, 1000, 300, 200, 4);
+    CHECK(r.settle_ms < 150);
+    CHECK_EQ(regulator_mode(), REG_MODE_CC);
+    r = run(500, 1000, 500, 200, 4);
+    CHECK(fabs(r.mean_ma - 1000) < 1);
+    CHECK(r.ripple_ma < CC_RIPPLE_MA);
+
+    // CC from 10V into 1..5 ohm. Ripple is the duty dithering between two
+    // counts, into 1 ohm one count is more than CC_RIPPLE_MA of current.
+    const double loads[] = { 1, 2, 5, 5 };
+    const uint16_t limits[] = { 1500, 1500, 1500, 500 };
+    for(uint8_t idx = 0; idx < 4; idx++) {
+        load_ohm_ = 1e6;
+        run(1000, 1500, 300, 1000, 5);
+        load_ohm_ = loads[idx];
+        run(1000, limits[idx], 400, 0, 1e6);
+        r = run(1000, limits[idx], 500, 0, 1e6);
+        double count_ma = 0.97 * 10 / (load_ohm_ + 0.5);
+        CHECK(fabs(r.mean_ma - limits[idx]) < 1);
+        CHECK(r.ripple_ma < CC_RIPPLE_MA || r.ripple_ma < count_ma);
+        CHECK_EQ(regulator_mode(), REG_MODE_CC);
+        printf("CC %.0f ohm, %u mA: error %.2f mA, ripple %.2f mA p-p\n",
+               load_ohm_, limits[idx], r.mean_ma - limits[idx], r.ripple_ma);
+    }
+    load_ohm_ = 2.0;
+    run(500, 1000, 300, 200, 4);
+
+    // short can't be limited below the 1.25V minimum, duty goes to 0
+    load_ohm_ = 0.1;
+    r = run(500, 1000, 300, 0, 1e6);
+    CHECK_EQ(r.duty, 0);
+    CHECK_EQ(regulator_mode(), REG_MODE_CC);
+
+    // load removed, output returns to CV setpoint without overshoot
+    load_ohm_ = 1e6;
+    r = run(500, 1000, 300, 500, 5);
+    CHECK(r.settle_ms < 200);
+    CHECK(r.peak < 505);
+    CHECK(fabs(r.final - 500) < 2);
+    CHECK_EQ(regulator_mode(), REG_MODE_CV);
+
+    return test_result("test_regulator");
+}
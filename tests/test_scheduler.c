@@ -0,0 +1,115 @@
+/*
+ * test_scheduler.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "regulator.h"
+#include <avr/io.h>
+
+/* ADC channel scheduler of the REGULATOR build: current on ADC0 in every
+ * slot but each REG_DIVIDER'th, which is output voltage on ADC1. Result of
+ * a conversion is given by the mux it was started with.
+ */
+#define CURRENT_MUX 0
+#define VOUT_MUX 1
+#define NO_UPDATE 0xFFFF // OCR1A left by a conversion without control step
+#define ADC_SETTLE_DOWN 16 // of peripherals.c
+
+extern volatile uint16_t iout_sample_, vout_sample_;
+extern volatile uint8_t adc_range_;
+
+uint16_t current_counts_ = 100;
+uint16_t vout_counts_ = 400;
+
+uint8_t on_11(void) {
+    return (ADMUX & _BV(REFS1)) != 0;
+}
+
+/* Runs one conversion, returns mux of it */
+uint8_t convert(void) {
+    uint8_t mux = ADMUX & 0x0F;
+    ADC = mux == VOUT_MUX ? vout_counts_ : current_counts_;
+    ADC_vect();
+    shim_run_events();
+    return mux;
+}
+
+int main(void) {
+    init_evq_timer();
+    set_voltage(500);
+    set_current_limit(2999);
+    init_adc();
+
+    // vout takes every REG_DIVIDER'th slot and control runs a fixed number
+    // of conversions after it, the rest is current. Both results go to
+    // their own channel.
+    uint16_t slots[2] = { 0, 0 };
+    long last_vout = -1, age = -1;
+    uint8_t updates = 0;
+    for(long idx = 0; idx < 100 * REG_DIVIDER; idx++) {
+        current_counts_ = 100 + idx % 50;
+        vout_counts_ = 400 + idx % 50;
+        OCR1A = NO_UPDATE;
+        uint8_t mux = convert();
+        CHECK(mux == CURRENT_MUX || mux == VOUT_MUX);
+        slots[mux]++;
+        if(mux == VOUT_MUX) {
+            CHECK(last_vout < 0 || idx - last_vout == REG_DIVIDER);
+            last_vout = idx;
+            CHECK_EQ(vout_sample_, vout_counts_);
+        } else {
+            CHECK_EQ(iout_sample_, current_counts_);
+        }
+        if(OCR1A != NO_UPDATE && last_vout >= 0) {
+            CHECK(age < 0 || idx - last_vout == age);
+            age = idx - last_vout;
+            updates++;
+        }
+    }
+    CHECK_EQ(slots[VOUT_MUX], 100);
+    CHECK_EQ(slots[CURRENT_MUX], 100 * (REG_DIVIDER - 1));
+    CHECK(updates >= 99);
+    CHECK(age >= 0 && age < REG_DIVIDER);
+
+    // vout follows the current range up, AREF settles within a conversion
+    current_counts_ = 1023;
+    while(on_11()) {
+        convert();
+    }
+    CHECK_EQ(adc_range_, ADC_RANGE_VCC);
+    current_counts_ = 300; // ~520mA on 5V, stays there
+    vout_counts_ = 77;
+    for(uint8_t idx = 0; idx < 2 * REG_DIVIDER; idx++) {
+        CHECK(!on_11());
+        convert();
+    }
+    CHECK_EQ(vout_sample_, 77);
+
+    // and back down, 1.1V takes ADC_SETTLE_DOWN conversions to settle and
+    // vout results of that window are not kept
+    current_counts_ = 20;
+    while(!on_11()) {
+        convert();
+    }
+    vout_counts_ = 55;
+    uint8_t vouts = 0;
+    for(uint8_t idx = 0; idx < ADC_SETTLE_DOWN; idx++) {
+        CHECK(on_11());
+        vouts += convert() == VOUT_MUX;
+    }
+    CHECK(vouts >= 2);
+    CHECK_EQ(vout_sample_, 77);
+    for(uint8_t idx = 0; idx < 2 * REG_DIVIDER; idx++) {
+        convert();
+    }
+    CHECK_EQ(vout_sample_, 55);
+
+    return test_result("test_scheduler");
+}
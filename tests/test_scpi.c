@@ -0,0 +1,147 @@
+/*
+ * test_scpi.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "scpi.h"
+#include <avr/io.h>
+#include <string.h>
+
+/* Commands go in through the UART receive ISR and replies come out of the
+ * data register empty ISR, as on the wire.
+ */
+char reply_[64];
+
+/* Sends line, returns the reply without its newline, "" if none */
+const char* send(const char* line) {
+    for(; *line; line++) {
+        UDR0 = *line;
+        USART_RX_vect();
+    }
+    UDR0 = '\n';
+    USART_RX_vect();
+    shim_run_events();
+
+    uint8_t len = 0;
+    for(;;) {
+        USART_UDRE_vect();
+        if(!(UCSR0B & _BV(UDRIE0))) {
+            break;
+        }
+        if(len < sizeof(reply_) - 1) {
+            reply_[len++] = UDR0;
+        }
+    }
+    if(len && reply_[len - 1] == '\n') {
+        len--;
+    }
+    reply_[len] = '\0';
+    return reply_;
+}
+
+uint8_t replies(const char* line, const char* expected) {
+    return strcmp(send(line), expected) == 0;
+}
+
+#define NO_ERROR "0,\"No error\""
+#define DATA_TYPE_ERROR "-104,\"Data type error\""
+#define MISSING_PARAMETER "-109,\"Missing parameter\""
+#define UNDEFINED_HEADER "-113,\"Undefined header\""
+#define OUT_OF_RANGE "-222,\"Data out of range\""
+
+int main(void) {
+    init_evq_timer();
+    init_uart(scpi_line_handler);
+    set_voltage(500);
+    set_current_limit(1000);
+
+    CHECK(replies("*IDN?", "tuopppi,adjustable-power-supply,0,1"));
+    CHECK(replies("SYST:ERR?", NO_ERROR));
+
+    // valid settings, case insensitive, extra fraction digits ignored
+    CHECK(replies("volt 5.25", ""));
+    CHECK(replies("VOLT?", "5.25"));
+    CHECK(replies("  VOLT   7", ""));
+    CHECK(replies("volt?", "7.00"));
+    CHECK(replies("CURR 0.5", ""));
+    CHECK(replies("CURR?", "0.500"));
+    CHECK(replies("CURR 1.2345", ""));
+    CHECK(replies("CURR?", "1.234"));
+    CHECK(replies("SYST:ERR?", NO_ERROR));
+
+    // out of range values are clamped and flagged, error clears on read
+    CHECK(replies("VOLT 20", ""));
+    CHECK(replies("VOLT?", "10.60"));
+    CHECK(replies("SYST:ERR?", OUT_OF_RANGE));
+    CHECK(replies("SYST:ERR?", NO_ERROR));
+    CHECK(replies("VOLT 0.5", ""));
+    CHECK(replies("VOLT?", "1.25"));
+    CHECK(replies("SYST:ERR?", OUT_OF_RANGE));
+    CHECK(replies("CURR 3.5", ""));
+    CHECK(replies("CURR?", "2.999"));
+    CHECK(replies("SYST:ERR?", OUT_OF_RANGE));
+    CHECK(replies("CURR 0.001", ""));
+    CHECK(replies("CURR?", "0.010"));
+    CHECK(replies("SYST:ERR?", OUT_OF_RANGE));
+
+    // malformed values leave the setting alone
+    set_voltage(500);
+    const char* malformed[] = {
+        "VOLT abc", "VOLT 5V", "VOLT 1.2.3", "VOLT .", "VOLT -5",
+        "VOLT 700.00", "VOLT 99999999"
+    };
+    for(uint8_t idx = 0; idx < sizeof(malformed) / sizeof(malformed[0]);
+        idx++) {
+        CHECK(replies(malformed[idx], ""));
+        CHECK(replies("SYST:ERR?", DATA_TYPE_ERROR));
+    }
+    CHECK(replies("VOLT?", "5.00"));
+
+    // missing parameter and unknown headers
+    CHECK(replies("VOLT", ""));
+    CHECK(replies("SYST:ERR?", MISSING_PARAMETER));
+    CHECK(replies("CURR   ", ""));
+    CHECK(replies("SYST:ERR?", MISSING_PARAMETER));
+    CHECK(replies("VOLTAGE 5", ""));
+    CHECK(replies("SYST:ERR?", UNDEFINED_HEADER));
+    CHECK(replies("MEAS:VOLT?", ""));
+    CHECK(replies("SYST:ERR?", UNDEFINED_HEADER));
+    CHECK(replies("TRAC:ARM", ""));
+    CHECK(replies("SYST:ERR?", UNDEFINED_HEADER));
+
+    // measured current comes from the filter in mA
+    *get_current() = 1234;
+    CHECK(replies("MEAS:CURR?", "1.234"));
+    *get_current() = 7;
+    CHECK(replies("MEAS:CURR?", "0.007"));
+
+    // output switch and mode
+    CHECK(replies("OUTP off", ""));
+    CHECK(replies("OUTP?", "0"));
+    CHECK(!output_enabled());
+    CHECK(replies("OUTP 1", ""));
+    CHECK(replies("OUTP?", "1"));
+    CHECK(replies("OUTP maybe", ""));
+    CHECK(replies("SYST:ERR?", DATA_TYPE_ERROR));
+    CHECK(replies("OUTP?", "1"));
+    CHECK(replies("OUTP:MODE?", "CV"));
+
+    // queue statistics, 3 high-water marks, 3 failure counts and timers
+    send("SYST:STAT?");
+    uint8_t fields = 1;
+    for(const char* p = reply_; *p; p++) {
+        fields += *p == ',';
+        CHECK(*p == ',' || (*p >= '0' && *p <= '9'));
+    }
+    CHECK_EQ(fields, 2 * EVQ_PRIORITIES + 2);
+    CHECK(replies("SYST:ERR?", NO_ERROR));
+
+    return test_result("test_scpi");
+}
@@ -0,0 +1,126 @@
+/*
+ * test_settings.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "settings.h"
+#include <string.h>
+
+#define SAVES 400
+#define WEAR_SAVES 1000000L
+#define RECORD_LEN 6
+#define SLOTS ((E2END + 1) / RECORD_LEN) // of settings.c
+#define ENDURANCE 100000L // write cycles of a cell, datasheet minimum
+
+uint8_t torn_[E2END + 1];
+
+/* Saves voltage and current limit and lets the writer finish */
+void save(uint16_t voltage, uint16_t limit) {
+    *get_voltage() = voltage;
+    *get_current_limit() = limit;
+    save_settings(0);
+    shim_eeprom_run(UINT16_MAX);
+    shim_run_events();
+}
+
+/* Checks what the next startup would read */
+void check_restored(uint16_t voltage, uint16_t limit) {
+    uint16_t restored_voltage = 0, restored_limit = 0;
+    CHECK_EQ(init_settings(&restored_voltage, &restored_limit), 1);
+    CHECK_EQ(restored_voltage, voltage);
+    CHECK_EQ(restored_limit, limit);
+}
+
+int main(void) {
+    init_evq_timer();
+    shim_eeprom_erase();
+
+    // erased EEPROM gives defaults
+    uint16_t voltage = 0, limit = 0;
+    CHECK_EQ(init_settings(&voltage, &limit), 0);
+    CHECK_EQ(voltage, SETTINGS_DEFAULT_VOLTAGE);
+    CHECK_EQ(limit, SETTINGS_DEFAULT_CURRENT_LIMIT);
+
+    // newest record is found after every save, over wraps of the slot ring
+    // and of the sequence number
+    for(uint16_t idx = 0; idx < SAVES; idx++) {
+        save(125 + idx, 1500 - idx);
+        check_restored(125 + idx, 1500 - idx);
+    }
+
+    // writes are spread over the whole EEPROM
+    uint16_t most = 0;
+    for(uint16_t addr = 0; addr <= E2END; addr++) {
+        if(shim_eeprom_writes[addr] > most) {
+            most = shim_eeprom_writes[addr];
+        }
+    }
+    CHECK(most <= SAVES * 6 / (E2END + 1) + 2);
+
+    // power lost after each byte of a record: the record before it is used
+    // and the next save goes over the torn one
+    for(uint16_t cut = 0; cut < 6; cut++) {
+        memcpy(torn_, shim_eeprom, sizeof(torn_));
+        *get_voltage() = 1000 + cut;
+        *get_current_limit() = 100 + cut;
+        save_settings(0);
+        if(shim_eeprom_run(cut) == cut) {
+            memcpy(torn_, shim_eeprom, sizeof(torn_));
+        }
+        shim_eeprom_run(UINT16_MAX);
+        shim_run_events();
+
+        memcpy(shim_eeprom, torn_, sizeof(torn_));
+        check_restored(125 + SAVES - 1, 1500 - SAVES + 1);
+
+        save(125 + SAVES - 1, 1500 - SAVES + 1);
+        check_restored(125 + SAVES - 1, 1500 - SAVES + 1);
+    }
+
+    // saves made while a record waits are merged into it
+    uint16_t programmed[E2END + 1];
+    memcpy(programmed, shim_eeprom_writes, sizeof(programmed));
+    *get_voltage() = 500;
+    save_settings(0);
+    *get_voltage() = 600;
+    save_settings(0);
+    shim_eeprom_run(UINT16_MAX);
+    shim_run_events();
+    check_restored(600, 1500 - SAVES + 1);
+    uint16_t cells = 0;
+    for(uint16_t addr = 0; addr <= E2END; addr++) {
+        cells += shim_eeprom_writes[addr] != programmed[addr];
+    }
+    CHECK(cells <= RECORD_LEN);
+
+    // every cell of the ring is written once per SLOTS saves at most
+    memset(shim_eeprom_writes, 0, sizeof(shim_eeprom_writes));
+    for(long idx = 0; idx < WEAR_SAVES; idx++) {
+        save(125 + idx * 7919 % 936, 10 + idx * 104729 % 2990);
+    }
+    check_restored(125 + (WEAR_SAVES - 1) * 7919 % 936,
+                   10 + (WEAR_SAVES - 1) * 104729 % 2990);
+    uint16_t least = UINT16_MAX;
+    uint32_t total = 0;
+    most = 0;
+    for(uint16_t addr = 0; addr < SLOTS * RECORD_LEN; addr++) {
+        uint16_t writes = shim_eeprom_writes[addr];
+        most = writes > most ? writes : most;
+        least = writes < least ? writes : least;
+        total += writes;
+    }
+    CHECK(most <= WEAR_SAVES / SLOTS + 1);
+    printf("%ld saves: cell writes min %u, mean %.1f, max %u, "
+           "%.1f M saves to %ld cycles\n", WEAR_SAVES, least,
+           (double)total / (SLOTS * RECORD_LEN), most,
+           (double)WEAR_SAVES * ENDURANCE / most / 1e6, ENDURANCE);
+
+    return test_result("test_settings");
+}
@@ -0,0 +1,122 @@
+/*
+ * test_spi.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include <avr/io.h>
+
+/* SPI frame queue. A byte is clocked out by taking SPDR and running the
+ * transfer complete ISR, a frame is latched when the ISR moves to the
+ * next frame.
+ */
+extern uint8_t spi_head_;
+extern volatile uint8_t spi_frames_;
+
+uint8_t out_[64];
+uint8_t out_len_;
+uint8_t latched_at_[16]; // out_len_ at each latch
+uint8_t latches_;
+
+uint16_t done_[8];
+uint8_t dones_;
+
+void done(uint16_t data) {
+    done_[dones_++] = data;
+}
+
+void clock_byte(void) {
+    // RCK is low while a frame is shifted in
+    CHECK(!(PORTC & _BV(PC5)));
+    out_[out_len_++] = SPDR;
+    uint8_t head = spi_head_;
+    SPI_STC_vect();
+    if(spi_head_ != head) {
+        latched_at_[latches_++] = out_len_;
+    }
+}
+
+void clock_all(void) {
+    while(spi_frames_) {
+        clock_byte();
+    }
+    CHECK(PORTC & _BV(PC5));
+}
+
+void clear(void) {
+    out_len_ = latches_ = dones_ = 0;
+}
+
+int main(void) {
+    init_evq_timer();
+    init_spi();
+
+    // zero high byte is sent, not taken for the end of the word
+    clear();
+    CHECK(spi_send_word(0x0012));
+    clock_all();
+    CHECK_EQ(out_len_, 2);
+    CHECK_EQ(out_[0], 0x12);
+    CHECK_EQ(out_[1], 0x00);
+    CHECK_EQ(latches_, 1);
+    CHECK_EQ(latched_at_[0], 2);
+
+    // all-zero frame of full length
+    clear();
+    const uint8_t zeros[SPI_FRAME_MAX] = { 0 };
+    CHECK(spi_send_frame(zeros, SPI_FRAME_MAX, done, 1));
+    clock_all();
+    CHECK_EQ(out_len_, SPI_FRAME_MAX);
+    for(uint8_t idx = 0; idx < SPI_FRAME_MAX; idx++) {
+        CHECK_EQ(out_[idx], 0);
+    }
+    CHECK_EQ(latched_at_[0], SPI_FRAME_MAX);
+    shim_run_events();
+    CHECK_EQ(dones_, 1);
+
+    // empty and over-long frames are refused
+    CHECK(!spi_send_frame(zeros, 0, 0, 0));
+    CHECK(!spi_send_frame(zeros, SPI_FRAME_MAX + 1, 0, 0));
+    CHECK_EQ(spi_frames_, 0);
+
+    // back-to-back frames go out in order, each latched on its own, and
+    // a full queue refuses the next one
+    clear();
+    const uint8_t a[] = { 0xA1, 0x00, 0xA3 };
+    const uint8_t b[] = { 0x00, 0xB2 };
+    const uint8_t c[] = { 0xC1 };
+    CHECK(spi_send_frame(a, sizeof(a), done, 'a'));
+    CHECK(spi_send_frame(b, sizeof(b), done, 'b'));
+    CHECK(!spi_send_frame(c, sizeof(c), done, 'c'));
+    clock_byte();
+    // frame a on the wire still holds its slot
+    CHECK(!spi_send_frame(c, sizeof(c), done, 'c'));
+    clock_byte();
+    clock_byte();
+    // a is latched, its slot is free
+    CHECK(spi_send_frame(c, sizeof(c), done, 'c'));
+    clock_all();
+
+    const uint8_t expected[] = { 0xA1, 0x00, 0xA3, 0x00, 0xB2, 0xC1 };
+    CHECK_EQ(out_len_, sizeof(expected));
+    for(uint8_t idx = 0; idx < sizeof(expected); idx++) {
+        CHECK_EQ(out_[idx], expected[idx]);
+    }
+    CHECK_EQ(latches_, 3);
+    CHECK_EQ(latched_at_[0], 3);
+    CHECK_EQ(latched_at_[1], 5);
+    CHECK_EQ(latched_at_[2], 6);
+    shim_run_events();
+    CHECK_EQ(dones_, 3);
+    CHECK_EQ(done_[0], 'a');
+    CHECK_EQ(done_[1], 'b');
+    CHECK_EQ(done_[2], 'c');
+
+    return test_result("test_spi");
+}
@@ -0,0 +1,405 @@
+/*
+ * test_system.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "controls.h"
+#include "display.h"
+#include "settings.h"
+#include "regulator.h"
+#include <avr/io.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Whole firmware under virtual time. Interrupt sources fire on a discrete
+ * event schedule in microseconds and the event loop runs between them, as
+ * if it took no time. Between events the output stage is integrated:
+ *
+ *   PWM duty -> 2 ms RC -> LM317 with 3% gain error and +80mV offset
+ *   -> 0.5 ohm source -> 1000uF output capacitor -> load
+ *
+ * Load is a resistor with an optional capacitor through its ESR in
+ * parallel. Current into the load is converted on ADC0 and the output
+ * through the 11:1 divider on ADC1, both with the AREF of test_trip and one
+ * count of noise. Knobs and buttons are driven through their pin change and
+ * external interrupts.
+ */
+#define TIMER2_US 128
+#define ADC_US (13 * 128 * 1000000UL / F_CPU)
+#define SPI_BYTE_US 2
+#define EE_BYTE_US 3300
+#define TAU_UP 0.05   // AREF, in conversions
+#define TAU_DOWN 3.0
+#define PWM_RC_MS 2.0
+#define SOURCE_OHM 0.5
+#define COUT_F 1000e-6
+#define OPEN_OHM 1e6
+#define SHORT_OHM 0.1
+#define TRIP_MARGIN_MA 100 // of peripherals.c
+#define VOUT_DIVIDER 11    // of peripherals.c
+#define CC_ERROR_MA 2
+#define CC_RIPPLE_MA 5      // peak to peak, 5V range counts are 1.7mA
+#define TRIP_CONVERSIONS 4  // worst case from over the limit to cut
+#define NEVER 0xFFFFFFFF
+
+extern volatile uint8_t adc_tripped_;
+extern volatile uint8_t spi_frames_;
+
+uint32_t now_;          // virtual time, us
+uint32_t next_timer_, next_adc_, next_spi_ = NEVER, next_ee_ = NEVER;
+uint32_t conversions_;
+
+// plant, volts and amps
+double pwm_;            // smoothed duty
+double vout_;
+double aref_ = 1.1;
+double load_ohm_ = OPEN_OHM;
+double cap_f_;          // 0 for none
+double cap_esr_ = 1;
+double cap_v_;
+
+// trip latency: from current first over the trip limit to output cut
+uint32_t over_at_ = NEVER;
+uint32_t trip_latency_max_;
+uint16_t trips_;
+
+double load_ma(void) {
+    double ma = vout_ / load_ohm_ * 1000;
+    if(cap_f_ > 0) {
+        ma += (vout_ - cap_v_) / cap_esr_ * 1000;
+    }
+    return ma;
+}
+
+void advance(uint32_t us) {
+    double s = us * 1e-6;
+    pwm_ += (OCR1A - pwm_) * (1 - exp(-s * 1000 / PWM_RC_MS));
+    double open = ((pwm_ + REG_VOLTAGE_OFFSET) * 0.97 + 8) / 100;
+
+    // output node relaxes towards what the source and load settle to
+    double g = 1 / SOURCE_OHM + 1 / load_ohm_;
+    double in = open / SOURCE_OHM;
+    if(cap_f_ > 0) {
+        g += 1 / cap_esr_;
+        in += cap_v_ / cap_esr_;
+    }
+    double settled = in / g;
+    vout_ = settled + (vout_ - settled) * exp(-s * g / COUT_F);
+    if(cap_f_ > 0) {
+        cap_v_ += (vout_ - cap_v_) * (1 - exp(-s / (cap_esr_ * cap_f_)));
+    }
+
+    if(over_at_ == NEVER && !adc_tripped_ &&
+       load_ma() > *get_current_limit() + TRIP_MARGIN_MA) {
+        over_at_ = now_;
+    }
+}
+
+uint16_t counts(double volts) {
+    double c = volts / aref_ * 1024 + 0.5 + (rand() % 3 - 1);
+    return c < 0 ? 0 : c > 1023 ? 1023 : c;
+}
+
+/* Finishes the conversion started with ADMUX and starts the next one */
+void convert(void) {
+    if((ADMUX & 0x0F) == 1) {
+        ADC = counts(vout_ / VOUT_DIVIDER);
+    } else {
+        ADC = counts(load_ma() * 2.86 / 1000);
+    }
+    ADC_vect();
+    conversions_++;
+
+    double target = (ADMUX & _BV(REFS1)) ? 1.1 : 5.0;
+    double tau = target < aref_ ? TAU_DOWN : TAU_UP;
+    aref_ = target + (aref_ - target) * exp(-1.0 / tau);
+
+    if(adc_tripped_ && OCR1A == 0 && over_at_ != NEVER) {
+        uint32_t latency = now_ - over_at_;
+        trip_latency_max_ = latency > trip_latency_max_ ? latency
+                                                        : trip_latency_max_;
+        trips_++;
+        over_at_ = NEVER;
+    }
+}
+
+uint32_t earliest(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+void run_us(uint32_t us) {
+    uint32_t end = now_ + us;
+    while(now_ < end) {
+        uint32_t next = earliest(earliest(next_timer_, next_adc_),
+                                 earliest(earliest(next_spi_, next_ee_), end));
+        advance(next - now_);
+        now_ = next;
+
+        if(now_ == next_timer_) {
+            shim_timer2_count();
+            next_timer_ += TIMER2_US;
+        }
+        if(now_ == next_adc_) {
+            convert();
+            next_adc_ += ADC_US;
+        }
+        if(now_ == next_spi_) {
+            SPI_STC_vect();
+            next_spi_ = NEVER;
+        }
+        if(now_ == next_ee_) {
+            shim_eeprom_run(1);
+            next_ee_ = NEVER;
+        }
+        shim_run_events();
+
+        // a transfer or programming in progress completes after its time
+        if(spi_frames_ && next_spi_ == NEVER) {
+            next_spi_ = now_ + SPI_BYTE_US;
+        }
+        if((EECR & _BV(EERIE)) && next_ee_ == NEVER) {
+            next_ee_ = now_ + EE_BYTE_US;
+        }
+    }
+}
+
+void run_ms(uint32_t ms) {
+    run_us(ms * 1000);
+}
+
+/* Scripted input ----------------------------------------------------------- */
+
+/* Pins idle high with their pull-ups */
+void release_all(void) {
+    PIND = _BV(PIND4) | _BV(PIND6);
+    PINB = _BV(PINB6);
+}
+
+/* Turns a knob detent by detent, B decides direction as A rises */
+void turn_voltage(int16_t detents, uint16_t interval_ms) {
+    for(; detents != 0; detents += detents > 0 ? -1 : 1) {
+        if(detents > 0) {
+            PINB &= ~_BV(PINB6);
+        } else {
+            PINB |= _BV(PINB6);
+        }
+        PIND |= _BV(PIND5);
+        PCINT2_vect();
+        run_ms(interval_ms / 2);
+        PIND &= ~_BV(PIND5);
+        PCINT2_vect();
+        run_ms(interval_ms - interval_ms / 2);
+    }
+}
+
+void turn_current(int16_t detents, uint16_t interval_ms) {
+    for(; detents != 0; detents += detents > 0 ? -1 : 1) {
+        if(detents > 0) {
+            PIND &= ~_BV(PIND6);
+        } else {
+            PIND |= _BV(PIND6);
+        }
+        PINB |= _BV(PINB7);
+        PCINT0_vect();
+        run_ms(interval_ms / 2);
+        PINB &= ~_BV(PINB7);
+        PCINT0_vect();
+        run_ms(interval_ms - interval_ms / 2);
+    }
+}
+
+/* Checks ----------------------------------------------------------------- */
+
+/* Output within 1% + 60mV of the setpoint, a vout count on 5V range */
+uint8_t at_setpoint(void) {
+    double set = *get_voltage() / 100.0;
+    return fabs(vout_ - set) <= set / 100 + 0.06;
+}
+
+/* Load current over ms, returns mean and stores peak to peak */
+double mean_ma(uint32_t ms, double* ripple) {
+    double sum = 0, low = 1e9, high = 0;
+    for(uint32_t idx = 0; idx < ms * 10; idx++) {
+        run_us(100);
+        double ma = load_ma();
+        sum += ma;
+        low = ma < low ? ma : low;
+        high = ma > high ? ma : high;
+    }
+    *ripple = high - low;
+    return sum / (ms * 10);
+}
+
+uint8_t queue_healthy(void) {
+    const evq_stats* stats = evq_get_stats();
+    uint8_t ok = stats->timer_failures == 0 &&
+                 stats->timers_high_water < EVQ_TIMED_BUFMAX &&
+                 stats->high_water[EVQ_CRITICAL] < EVQ_CRITICAL_BUFMAX &&
+                 stats->high_water[EVQ_NORMAL] < EVQ_NORMAL_BUFMAX &&
+                 stats->high_water[EVQ_BACKGROUND] < EVQ_BACKGROUND_BUFMAX;
+    for(uint8_t prio = 0; prio < EVQ_PRIORITIES; prio++) {
+        ok = ok && stats->push_failures[prio] == 0;
+    }
+    return ok;
+}
+
+/* Same order as initialize() of main.c */
+void boot(void) {
+    uint16_t voltage, current_limit;
+
+    init_evq_timer();
+    init_settings(&voltage, &current_limit);
+    set_current_limit(current_limit);
+    set_voltage(voltage);
+    init_voltage_pwm();
+    init_display();
+    init_controls();
+    init_adc();
+
+    set_dynamic_readout(get_voltage());
+    status_led_on(LED_VOLTAGE);
+    next_adc_ = ADC_US;
+    next_timer_ = TIMER2_US;
+}
+
+int main(void) {
+    srand(1);
+    shim_eeprom_erase();
+    release_all();
+    clock_t started = clock();
+
+    // erased EEPROM boots to the defaults and the minimum output
+    boot();
+    run_ms(100);
+    CHECK_EQ(*get_voltage(), SETTINGS_DEFAULT_VOLTAGE);
+    CHECK_EQ(*get_current_limit(), SETTINGS_DEFAULT_CURRENT_LIMIT);
+    CHECK(at_setpoint());
+
+    // knob to 5V at a slow pace, one step a detent, output follows
+    turn_voltage((500 - 125) / 5, 60);
+    CHECK_EQ(*get_voltage(), 500);
+    run_ms(50);
+    CHECK(at_setpoint());
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+
+    // fast spin is accelerated and lands on the limit, back down to 10V
+    turn_voltage(200, 5);
+    CHECK_EQ(*get_voltage(), 1060);
+    turn_voltage(-12, 60);
+    CHECK_EQ(*get_voltage(), 1000);
+    run_ms(100);
+    CHECK(at_setpoint());
+
+    // settings are saved 3s after the last turn
+    run_ms(3500);
+    uint16_t saved_v, saved_c;
+    CHECK(init_settings(&saved_v, &saved_c));
+    CHECK_EQ(saved_v, 1000);
+    CHECK_EQ(saved_c, SETTINGS_DEFAULT_CURRENT_LIMIT);
+
+    // limit up to 1A, 20 ohm at 10V stays in CV
+    turn_current((1000 - 200) / 10, 60);
+    CHECK_EQ(*get_current_limit(), 1000);
+    load_ohm_ = 20;
+    run_ms(100);
+    CHECK(at_setpoint());
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+
+    // resistive step to 5 ohm trips, resuming trips again and CC takes
+    // over from zero duty to hold the limit
+    load_ohm_ = 5;
+    run_ms(300);
+    CHECK_EQ(output_mode(), REG_MODE_CC);
+    double ripple;
+    double ma = mean_ma(100, &ripple);
+    CHECK(fabs(ma - 1000) < CC_ERROR_MA);
+    CHECK(ripple < CC_RIPPLE_MA);
+    printf("system: CC into 5 ohm %.1fmA, ripple %.1fmA\n", ma, ripple);
+
+    // limit turned down while in CC, current follows it
+    turn_current(-50, 60);
+    CHECK_EQ(*get_current_limit(), 500);
+    run_ms(300);
+    ma = mean_ma(100, &ripple);
+    CHECK(fabs(ma - 500) < CC_ERROR_MA);
+    CHECK(ripple < CC_RIPPLE_MA);
+
+    // load removed, back to the setpoint in CV
+    load_ohm_ = OPEN_OHM;
+    run_ms(300);
+    CHECK(at_setpoint());
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+
+    // short: output capacitor dumps into it and the ADC ISR cuts the
+    // output. From 1.1V range it takes the saturated sample, the settling
+    // one, at most one vout slot and the tripping sample. It stays cut while
+    // shorted, the 1.25V minimum into 0.1 ohm is still over the trip limit.
+    uint16_t trips = trips_;
+    load_ohm_ = SHORT_OHM;
+    run_ms(50);
+    CHECK_EQ(trips_, trips + 1);
+    CHECK(trip_latency_max_ <= TRIP_CONVERSIONS * ADC_US);
+    CHECK_EQ(adc_tripped_, 1);
+    CHECK_EQ(OCR1A, 0);
+    printf("system: short tripped in %luus\n",
+           (unsigned long)trip_latency_max_);
+
+    // short removed, output comes back to the setpoint
+    load_ohm_ = OPEN_OHM;
+    run_ms(200);
+    CHECK_EQ(adc_tripped_, 0);
+    CHECK(at_setpoint());
+
+    // discharged 2200uF with 0.2 ohm ESR plugged in at 10V. Inrush trips,
+    // the output recovers and charges it within the limit.
+    trip_latency_max_ = 0;
+    trips = trips_;
+    cap_f_ = 2200e-6;
+    cap_esr_ = 0.2;
+    cap_v_ = 0;
+    run_ms(1000);
+    CHECK(trips_ > trips);
+    CHECK(trip_latency_max_ <= TRIP_CONVERSIONS * ADC_US);
+    CHECK_EQ(adc_tripped_, 0);
+    CHECK(at_setpoint());
+    CHECK_EQ(output_mode(), REG_MODE_CV);
+    printf("system: inrush tripped %u times, worst %luus\n", trips_ - trips,
+           (unsigned long)trip_latency_max_);
+    cap_f_ = 0;
+
+    // voltage knob is ignored while the top button is held
+    PIND &= ~_BV(PIND4);
+    PCINT2_vect();
+    turn_voltage(-50, 60);
+    CHECK_EQ(*get_voltage(), 1000);
+    PIND |= _BV(PIND4);
+    PCINT2_vect();
+    turn_voltage(-100, 60);
+    CHECK_EQ(*get_voltage(), 500);
+    INT0_vect();
+    run_ms(300);
+    CHECK(at_setpoint());
+
+    // nothing was dropped on the way
+    run_ms(3500);
+    CHECK(queue_healthy());
+    CHECK(!(EECR & _BV(EERIE)));
+    CHECK(init_settings(&saved_v, &saved_c));
+    CHECK_EQ(saved_v, 500);
+    CHECK_EQ(saved_c, 500);
+
+    double wall = (double)(clock() - started) / CLOCKS_PER_SEC;
+    printf("system: %.1fs virtual in %.2fs, %lu conversions\n", now_ / 1e6,
+           wall, (unsigned long)conversions_);
+
+    return test_result("test_system");
+}
@@ -0,0 +1,134 @@
+/*
+ * test_telemetry.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "telemetry.h"
+#include <util/crc16.h>
+
+/* Throughput of the telemetry stream at one frame per sample. Conversions
+ * take 13 ADC clocks of F_CPU / 128, the line sends baud / 10 bytes per
+ * second and TIMER2 counts at F_CPU / 1024.
+ */
+#define SAMPLE_RATE (F_CPU / 128 / 13)
+#define SECONDS 5
+
+typedef struct {
+    uint32_t frames;
+    uint32_t bad;       // sync found but CRC failed
+    uint32_t lost;      // gaps in sequence numbers
+    int16_t prev_seq;
+    uint8_t frame[TELEMETRY_FRAME_LEN];
+    uint8_t len;
+} decoder;
+
+/* Same resynchronizing decoder as tools/telemetry_decode.py */
+void decode(decoder* dec, uint8_t byte) {
+    if(dec->len == 0 && byte != TELEMETRY_SYNC) {
+        return;
+    }
+    dec->frame[dec->len++] = byte;
+    if(dec->len < TELEMETRY_FRAME_LEN) {
+        return;
+    }
+    dec->len = 0;
+
+    uint8_t crc = 0xFF;
+    for(uint8_t idx = 1; idx < TELEMETRY_FRAME_LEN - 1; idx++) {
+        crc = _crc8_ccitt_update(crc, dec->frame[idx]);
+    }
+    if(crc != dec->frame[TELEMETRY_FRAME_LEN - 1]) {
+        dec->bad++;
+        return;
+    }
+    if(dec->prev_seq >= 0) {
+        dec->lost += (uint8_t)(dec->frame[1] - dec->prev_seq - 1);
+    }
+    dec->prev_seq = dec->frame[1];
+    dec->frames++;
+}
+
+/* Current into the sense amplifier as ADC counts of the selected reference */
+uint16_t convert(uint32_t sample) {
+    uint16_t ma = sample % 1600 < 800 ? sample % 800 : 800 - sample % 800;
+    uint32_t ref_mv = ADMUX & _BV(REFS1) ? 1100 : 5000;
+    uint32_t counts = (uint32_t)ma * 286 * 1024 / 100 / ref_mv;
+    return counts < 1023 ? counts : 1023;
+}
+
+void run(uint32_t baud, decoder* dec) {
+    uint32_t line_budget = 0;   // bytes * SAMPLE_RATE
+    uint32_t timer_budget = 0;  // TIMER2 counts * SAMPLE_RATE
+    dec->prev_seq = -1;
+
+    for(uint32_t sample = 0; sample < SECONDS * SAMPLE_RATE; sample++) {
+        ADC = convert(sample);
+        ADC_vect();
+        shim_run_events();
+
+        // line does not save up time while it is idle
+        line_budget += baud / 10;
+        while(line_budget >= SAMPLE_RATE) {
+            line_budget -= SAMPLE_RATE;
+            if(!(UCSR0B & _BV(UDRIE0))) {
+                line_budget = 0;
+                break;
+            }
+            USART_UDRE_vect();
+            if(UCSR0B & _BV(UDRIE0)) {
+                decode(dec, UDR0);
+            }
+        }
+
+        timer_budget += F_CPU / 1024;
+        while(timer_budget >= SAMPLE_RATE) {
+            timer_budget -= SAMPLE_RATE;
+            shim_timer2_count();
+            shim_run_events();
+        }
+    }
+}
+
+int main(void) {
+    init_evq_timer();
+    init_uart(0);
+    set_current_limit(500);
+    init_adc();
+
+    // 500 kBd carries every sample
+    decoder fast = { 0 };
+    run(500000, &fast);
+    printf("500 kBd: %lu samples/s, %lu frames/s, %u dropped\n",
+           SAMPLE_RATE, (unsigned long)fast.frames / SECONDS,
+           telemetry_dropped());
+    CHECK(fast.frames >= SECONDS * SAMPLE_RATE - 1);
+    CHECK_EQ(telemetry_dropped(), 0);
+    CHECK_EQ(fast.bad, 0);
+    CHECK_EQ(fast.lost, 0);
+
+    // a slower line drops whole frames, which the receiver sees as gaps
+    decoder slow = { 0 };
+    run(250000, &slow);
+    printf("250 kBd: %lu samples/s, %lu frames/s, %u dropped\n",
+           SAMPLE_RATE, (unsigned long)slow.frames / SECONDS,
+           telemetry_dropped());
+    CHECK(slow.frames >= SECONDS * 25000 / 10 * 9 / 10);
+    CHECK(telemetry_dropped() > 0);
+    CHECK_EQ(slow.bad, 0);
+    // drops after the last frame received are not seen yet, at most one
+    // per frame waiting in the 64 byte TX buffer
+    CHECK(slow.lost <= telemetry_dropped());
+    CHECK(telemetry_dropped() - slow.lost <= 64 / TELEMETRY_FRAME_LEN);
+
+    // control path got every sample
+    CHECK_EQ(evq_get_stats()->push_failures[EVQ_CRITICAL], 0);
+
+    return test_result("test_telemetry");
+}
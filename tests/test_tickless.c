@@ -0,0 +1,139 @@
+/*
+ * test_tickless.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include <stdlib.h>
+
+/* EVQ_TICKLESS build: ticks are 8 counts of F_CPU / 1024 and the 8-bit
+ * counter overflows every 32 ticks, so an idle second has ~30.5 wakeups.
+ */
+#define COUNTS_PER_S (F_CPU / 1024)
+#define TIMERS 16
+#define WHEEL_LEVELS 4
+
+uint16_t fired_at_[TIMERS];
+uint8_t fired_[TIMERS];
+
+void fire(uint16_t idx) {
+    fired_at_[idx] = evq_time();
+    fired_[idx]++;
+}
+
+void clear_fired(void) {
+    for(uint8_t idx = 0; idx < TIMERS; idx++) {
+        fired_[idx] = 0;
+    }
+}
+
+// repeats every 10 ms like the display refresh
+uint8_t refresh_late_;
+
+void refresh(uint16_t due) {
+    if(evq_time() != due) {
+        refresh_late_++;
+    }
+    evq_timed_push(refresh, due + 10, 10, EVQ_NORMAL);
+}
+
+/* Runs TIMER2 and the event loop for counts of TIMER2, returns ISRs run */
+uint32_t run_counts(uint32_t counts) {
+    uint32_t isrs = shim_timer2_isrs;
+    while(counts--) {
+        shim_timer2_count();
+        shim_run_events();
+    }
+    return shim_timer2_isrs - isrs;
+}
+
+/* Runs for ms ticks */
+void advance(uint16_t ms) {
+    uint16_t end = evq_time() + ms;
+    while(evq_time() != end) {
+        shim_timer2_count();
+        shim_run_events();
+    }
+}
+
+int main(void) {
+    init_evq_timer();
+
+    // idle wakes only on overflows of the clock
+    uint32_t isrs = run_counts(10 * COUNTS_PER_S);
+    CHECK(isrs >= 10 * COUNTS_PER_S / 256);
+    CHECK(isrs <= 10 * COUNTS_PER_S / 256 + 1);
+
+    // delays around overflows and wheel levels fire on their tick
+    const uint16_t delays[] = {
+        1, 2, 31, 32, 33, 255, 256, 257, 4095, 4096, 4097, 30000,
+        EVQ_TIMED_MAXMS
+    };
+    for(uint8_t idx = 0; idx < sizeof(delays) / sizeof(delays[0]); idx++) {
+        clear_fired();
+        uint16_t due = evq_time() + delays[idx];
+        CHECK(evq_timed_push(fire, 0, delays[idx], EVQ_NORMAL));
+        advance(delays[idx] - 1);
+        CHECK_EQ(fired_[0], 0);
+        advance(1);
+        CHECK_EQ(fired_[0], 1);
+        CHECK_EQ(fired_at_[0], due);
+    }
+
+    // empty ticks between work are skipped, catch-up runs each timer on
+    // its own tick
+    srand(1);
+    for(uint8_t round = 0; round < 20; round++) {
+        uint16_t due[TIMERS];
+        clear_fired();
+        for(uint8_t idx = 0; idx < TIMERS; idx++) {
+            uint16_t wait = rand() % 4 ? 1 + rand() % 300 : 1 + rand() % 6000;
+            due[idx] = evq_time() + wait;
+            evq_timed_push(fire, idx, wait, EVQ_NORMAL);
+            advance(rand() % 20);
+        }
+        isrs = shim_timer2_isrs;
+        advance(6000);
+        // overflows, and a match per timer and per cascade of it at most
+        CHECK(shim_timer2_isrs - isrs <= 6000 / 32 + 1 + WHEEL_LEVELS * TIMERS);
+        for(uint8_t idx = 0; idx < TIMERS; idx++) {
+            CHECK_EQ(fired_[idx], 1);
+            CHECK_EQ(fired_at_[idx], due[idx]);
+        }
+    }
+    CHECK_EQ(evq_timers_in_use(), 0);
+
+    // ticks passed with interrupts held off are caught up by the next push
+    clear_fired();
+    while(TCNT2 != 0) {
+        shim_timer2_count();
+    }
+    uint16_t start = evq_time();
+    evq_timed_push(fire, 1, 5, EVQ_NORMAL);
+    evq_timed_push(fire, 2, 7, EVQ_NORMAL);
+    TCNT2 += 10 * 8;
+    evq_timed_push(fire, 3, 1, EVQ_NORMAL);
+    shim_run_events();
+    CHECK_EQ(fired_[1], 1);
+    CHECK_EQ(fired_[2], 1);
+    CHECK_EQ(fired_at_[1], start + 10);
+    CHECK_EQ(fired_[3], 0);
+    advance(1);
+    CHECK_EQ(fired_[3], 1);
+    CHECK_EQ(fired_at_[3], start + 11);
+
+    // 10 ms refresh keeps its period with ~100 matches and the overflows
+    refresh(evq_time());
+    isrs = run_counts(10 * COUNTS_PER_S);
+    CHECK_EQ(refresh_late_, 0);
+    CHECK(isrs >= 10 * (1000 / 10.24) && isrs <= 10 * (1000 / 10.24 + 32));
+    printf("tickless ISRs/s: idle %.1f, 10 ms refresh %.1f\n",
+           COUNTS_PER_S / 256.0, isrs / 10.0);
+
+    return test_result("test_tickless");
+}
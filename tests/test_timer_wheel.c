@@ -0,0 +1,142 @@
+/*
+ * test_timer_wheel.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include <stdlib.h>
+
+#define TIMERS 32
+
+uint16_t fired_at_[TIMERS];
+uint8_t fired_[TIMERS];
+
+void fire(uint16_t idx) {
+    fired_at_[idx] = evq_time();
+    fired_[idx]++;
+}
+
+void clear_fired(void) {
+    for(uint8_t idx = 0; idx < TIMERS; idx++) {
+        fired_[idx] = 0;
+    }
+}
+
+void filler(uint16_t data) {
+}
+
+/* Runs TIMER2 and the event loop for ms ticks */
+void advance(uint16_t ms) {
+    uint16_t end = evq_time() + ms;
+    while(evq_time() != end) {
+        shim_timer2_count();
+        shim_run_events();
+    }
+}
+
+int main(void) {
+    init_evq_timer();
+
+    // delays around level boundaries of the wheel fire on their tick
+    const uint16_t delays[] = {
+        1, 2, 15, 16, 17, 255, 256, 257, 4095, 4096, 4097, 30000,
+        EVQ_TIMED_MAXMS
+    };
+    for(uint8_t idx = 0; idx < sizeof(delays) / sizeof(delays[0]); idx++) {
+        clear_fired();
+        uint16_t due = evq_time() + delays[idx];
+        CHECK(evq_timed_push(fire, 0, delays[idx], EVQ_NORMAL));
+        advance(delays[idx] - 1);
+        CHECK_EQ(fired_[0], 0);
+        advance(1);
+        CHECK_EQ(fired_[0], 1);
+        CHECK_EQ(fired_at_[0], due);
+    }
+
+    // zero delay fires on the next tick
+    clear_fired();
+    evq_timed_push(fire, 0, 0, EVQ_NORMAL);
+    advance(1);
+    CHECK_EQ(fired_[0], 1);
+
+    // concurrent timers, wheel time is also wrapped around
+    srand(1);
+    for(uint8_t round = 0; round < 20; round++) {
+        uint16_t due[16];
+        clear_fired();
+        for(uint8_t idx = 0; idx < 16; idx++) {
+            uint16_t wait = rand() % 4 ? 1 + rand() % 300 : 1 + rand() % 6000;
+            due[idx] = evq_time() + wait;
+            evq_timed_push(fire, idx, wait, EVQ_NORMAL);
+            advance(rand() % 20);
+        }
+        advance(6000);
+        for(uint8_t idx = 0; idx < 16; idx++) {
+            CHECK_EQ(fired_[idx], 1);
+            CHECK_EQ(fired_at_[idx], due[idx]);
+        }
+    }
+    CHECK_EQ(evq_timers_in_use(), 0);
+
+    // push with the same key restarts the timer
+    clear_fired();
+    uint16_t start = evq_time();
+    evq_timed_push(fire, 1, 100, EVQ_NORMAL);
+    advance(50);
+    evq_timed_push(fire, 1, 100, EVQ_NORMAL);
+    CHECK_EQ(evq_timers_in_use(), 1);
+    advance(200);
+    CHECK_EQ(fired_[1], 1);
+    CHECK_EQ(fired_at_[1], start + 150);
+
+    // cancelled timer does not fire and is freed
+    clear_fired();
+    evq_timed_push(fire, 2, 300, EVQ_NORMAL);
+    evq_timed_push(fire, 3, 300, EVQ_NORMAL);
+    evq_timed_cancel(fire, 2);
+    CHECK_EQ(evq_timers_in_use(), 1);
+    advance(400);
+    CHECK_EQ(fired_[2], 0);
+    CHECK_EQ(fired_[3], 1);
+    CHECK_EQ(evq_timers_in_use(), 0);
+
+    // push fails when all timers are in use, and works again after
+    clear_fired();
+    uint8_t pushed = 0;
+    while(pushed < TIMERS && evq_timed_push(fire, pushed, 10 + pushed,
+                                            EVQ_NORMAL)) {
+        pushed++;
+    }
+    CHECK(pushed > 0 && pushed < TIMERS);
+    CHECK_EQ(evq_timers_in_use(), pushed);
+    advance(10 + pushed);
+    for(uint8_t idx = 0; idx < pushed; idx++) {
+        CHECK_EQ(fired_[idx], 1);
+    }
+    CHECK(evq_timed_push(fire, 0, 1, EVQ_NORMAL));
+    advance(1);
+
+    // timer due while its ring is full fires on a later tick, not lost
+    clear_fired();
+    for(uint8_t idx = 0; idx < EVQ_CRITICAL_BUFMAX; idx++) {
+        evq_push(filler, idx, EVQ_CRITICAL);
+    }
+    start = evq_time();
+    evq_timed_push(fire, 4, 5, EVQ_CRITICAL);
+    while(evq_time() != (uint16_t)(start + 10)) {
+        shim_timer2_count();
+    }
+    CHECK_EQ(fired_[4], 0);
+    shim_run_events();
+    advance(1);
+    CHECK_EQ(fired_[4], 1);
+    CHECK_EQ(fired_at_[4], start + 11);
+    CHECK_EQ(evq_timers_in_use(), 0);
+
+    return test_result("test_timer_wheel");
+}
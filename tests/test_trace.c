@@ -0,0 +1,108 @@
+/*
+ * test_trace.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "trace.h"
+#include "filter.h"
+#include <stdlib.h>
+
+#define FED_MAX 4000
+
+uint16_t adc_to_current(uint16_t sample, uint8_t range);
+
+uint16_t fed_[FED_MAX];
+uint16_t dumped_[FED_MAX];
+
+/* Runs the dump and parses the line it writes to UART */
+uint16_t dump(void) {
+    uint16_t count = 0, value = 0;
+    uint8_t digits = 0, done = 0;
+
+    trace_dump();
+    while(!done) {
+        // a chunk which did not fit is retried from a timer
+        shim_timer2_count();
+        shim_run_events();
+        USART_UDRE_vect();
+        if(!(UCSR0B & _BV(UDRIE0))) {
+            continue;
+        }
+        char c = UDR0;
+        if(c >= '0' && c <= '9') {
+            value = value * 10 + c - '0';
+            digits++;
+            continue;
+        }
+        if(digits) {
+            dumped_[count++] = value;
+        }
+        value = 0;
+        digits = 0;
+        done = c == '\n';
+    }
+    return count;
+}
+
+/* Steady load current in mA with +-1 LSB of ADC noise, rounded as
+ * current_handeler passes it to the trace
+ */
+uint16_t noisy_current(uint16_t counts, uint8_t range) {
+    uint16_t current = adc_to_current(counts + rand() % 3 - 1, range);
+    return (current + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+}
+
+int main(void) {
+    init_evq_timer();
+    init_uart(0);
+    set_current_limit(500);
+    trace_arm();
+
+    // noisy current under the limit fills the ring, then crosses it with
+    // steps of up to 40mA
+    uint16_t fed = 0, trigger = 0;
+    for(; fed < 1000; fed++) {
+        fed_[fed] = 100 + rand() % 40;
+        trace_sample(fed_[fed]);
+    }
+    for(; fed < 2000; fed++) {
+        fed_[fed] = noisy_current(fed < 1500 ? 300 : 800, ADC_RANGE_11);
+        trace_sample(fed_[fed]);
+    }
+    CHECK_EQ(trace_get_state(), TRACE_ARMED);
+    trigger = fed;
+    while(trace_get_state() != TRACE_STOPPED && fed < FED_MAX) {
+        fed_[fed] = 600 + rand() % 40;
+        trace_sample(fed_[fed++]);
+    }
+    CHECK_EQ(trace_get_state(), TRACE_STOPPED);
+
+    // dump is the end of the fed samples up to the stop, oldest first
+    uint16_t count = dump();
+    uint16_t post = trace_post_samples();
+    CHECK(count > post);
+    CHECK(post > 0);
+    uint16_t first = trigger + post - count;
+    for(uint16_t idx = 0; idx < count; idx++) {
+        CHECK_EQ(dumped_[idx], fed_[first + idx]);
+    }
+
+    // history before the trigger keeps the share of the ring post trigger
+    // data does not use, ADC noise at three times the samples of raw
+    // uint16_t storage at least
+    uint16_t history = count - post;
+    uint16_t share = (TRACE_BLOCKS - TRACE_POST_BLOCKS) * TRACE_BLOCK_SIZE;
+    CHECK(history >= 3 * share / 2);
+    printf("history %u samples in %u bytes\n", history, share);
+    CHECK(post >= TRACE_POST_BLOCKS * TRACE_BLOCK_SIZE / 2);
+    CHECK(post <= TRACE_POST_BLOCKS * TRACE_BLOCK_SIZE);
+
+    return test_result("test_trace");
+}
@@ -0,0 +1,117 @@
+/*
+ * test_trip.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include "regulator.h"
+#include <math.h>
+
+/* Overcurrent trip in ADC ISR, current fed through the same AREF model as
+ * test_autorange. Trip latency is counted in conversions from the first
+ * sample over the trip limit to OCR1A cleared.
+ */
+#define TAU_UP 0.05
+#define TAU_DOWN 3.0
+#define TRIP_MARGIN_MA 100 // of peripherals.c
+
+extern volatile uint8_t adc_tripped_;
+
+double aref_ = 1.1;
+
+uint16_t convert(double ma) {
+    double counts = ma * 2.86 / 1000.0 / aref_ * 1024;
+    return counts > 1023 ? 1023 : counts + 0.5;
+}
+
+void step_aref(void) {
+    double target = (ADMUX & _BV(REFS1)) ? 1.1 : 5.0;
+    double tau = target < aref_ ? TAU_DOWN : TAU_UP;
+    aref_ = target + (aref_ - target) * exp(-1.0 / tau);
+}
+
+uint8_t on_11(void) {
+    return (ADMUX & _BV(REFS1)) != 0;
+}
+
+/* Runs n conversions of ma, returns conversions until one tripped and
+ * left OCR1A cleared, n if none did
+ */
+uint16_t run(double ma, uint16_t n) {
+    uint16_t cut = n;
+    for(uint16_t idx = 0; idx < n; idx++) {
+        ADC = convert(ma);
+        ADC_vect();
+        step_aref();
+        shim_run_events();
+        if(adc_tripped_ && OCR1A == 0 && cut == n) {
+            cut = idx;
+        }
+    }
+    return cut;
+}
+
+int main(void) {
+    init_evq_timer();
+    set_voltage(500);
+    set_current_limit(2000);
+    init_adc();
+
+    // upward step saturates 1.1V once, limit is far above so no trip
+    CHECK_EQ(run(100, 100), 100);
+    CHECK(on_11());
+    CHECK_EQ(run(500, 100), 100);
+    CHECK(!on_11());
+    CHECK_EQ(adc_tripped_, 0);
+
+    // 1.1V range: first sample over 200mA + margin cuts the output
+    set_current_limit(200);
+    run(100, 100);
+    CHECK(on_11());
+    CHECK_EQ(run(200 + TRIP_MARGIN_MA + 20, 1), 0);
+    CHECK_EQ(adc_tripped_, 1);
+
+    // back under the limit, control loop restores the duty
+    CHECK_EQ(run(100, 1), 1);
+    CHECK_EQ(adc_tripped_, 0);
+    run(100, REG_DIVIDER - 1);
+    CHECK(OCR1A > 0);
+
+    // 5V range, same
+    set_current_limit(1000);
+    run(800, 100);
+    CHECK(!on_11());
+    CHECK(OCR1A > 0);
+    CHECK_EQ(run(1000 + TRIP_MARGIN_MA + 20, 1), 0);
+    CHECK_EQ(adc_tripped_, 1);
+    run(800, REG_DIVIDER + 1);
+    CHECK_EQ(adc_tripped_, 0);
+    CHECK(OCR1A > 0);
+
+    // limit past 5V full scale trips on saturation
+    set_current_limit(2999);
+    run(1500, 100);
+    CHECK_EQ(adc_tripped_, 0);
+    CHECK_EQ(run(2500, 1), 0);
+
+    // limit just under the 384mA full scale of 1.1V, from 1.1V range
+    set_current_limit(250);
+    run(100, 100);
+    CHECK(on_11());
+    CHECK_EQ(run(600, 1), 0);
+
+    // and just past it: the saturated sample switches up, 5V sample trips
+    set_current_limit(300);
+    run(100, 100);
+    CHECK(on_11());
+    uint16_t cut = run(600, 4);
+    CHECK(cut >= 1 && cut <= 3);
+
+    return test_result("test_trip");
+}
@@ -0,0 +1,76 @@
+/*
+ * test_uart_rx.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "test.h"
+#include "shim.h"
+#include "eventqueue.h"
+#include "peripherals.h"
+#include <string.h>
+
+char received_[4][UART_RX_LINE_MAX];
+uint8_t lines_ = 0;
+uint8_t hold_ = 0; // handler keeps its buffers
+
+void line_handler(uint16_t idx) {
+    strcpy(received_[lines_++ % 4], uart_line(idx));
+    if(!hold_) {
+        uart_line_done(idx);
+    }
+}
+
+void receive(const char* text) {
+    for(; *text; text++) {
+        UDR0 = *text;
+        USART_RX_vect();
+    }
+}
+
+int main(void) {
+    init_evq_timer();
+    init_uart(line_handler);
+
+    // CR LF and LF both end a line, empty lines are skipped
+    receive("*IDN?\r\n\nVOLT 5\n");
+    shim_run_events();
+    CHECK_EQ(lines_, 2);
+    CHECK(strcmp(received_[0], "*IDN?") == 0);
+    CHECK(strcmp(received_[1], "VOLT 5") == 0);
+
+    // longest line fits, one character more drops the whole line
+    char line[UART_RX_LINE_MAX + 2];
+    lines_ = 0;
+    memset(line, 'A', UART_RX_LINE_MAX - 1);
+    strcpy(line + UART_RX_LINE_MAX - 1, "\n");
+    receive(line);
+    memset(line, 'B', UART_RX_LINE_MAX);
+    strcpy(line + UART_RX_LINE_MAX, "\n");
+    receive(line);
+    receive("VOLT 6\n");
+    shim_run_events();
+    CHECK_EQ(lines_, 2);
+    CHECK_EQ(strlen(received_[0]), UART_RX_LINE_MAX - 1);
+    CHECK(strcmp(received_[1], "VOLT 6") == 0);
+
+    // line which starts while no buffer is free is dropped whole, also
+    // when a buffer is freed in the middle of it
+    lines_ = 0;
+    hold_ = 1;
+    receive("VOLT 7\nVOLT 8\n");
+    shim_run_events();
+    CHECK_EQ(lines_, 2);
+    receive("VOLT");
+    uart_line_done(0);
+    uart_line_done(1);
+    hold_ = 0;
+    receive(" 9\nVOLT 10\n");
+    shim_run_events();
+    CHECK_EQ(lines_, 3);
+    CHECK(strcmp(received_[2], "VOLT 10") == 0);
+
+    return test_result("test_uart_rx");
+}
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+#
+# telemetry_decode.py
+#
+# Decodes telemetry frames (see telemetry.h) from a serial port or a
+# capture file and prints them as CSV. Frames with a bad CRC are skipped
+# and the decoder resynchronizes on the next sync byte.
+#
+# usage: telemetry_decode.py /dev/ttyUSB0 [baud]
+#        telemetry_decode.py capture.bin
+#
+# This file is part of variable-power-supply project.
+
+import struct
+import sys
+
+SYNC = 0xA5
+FRAME_LEN = 10
+FRAC_BITS = 4
+
+FLAG_OVER_LIMIT = 0x01
+FLAG_RANGE_VCC = 0x02
+FLAG_SETTLING = 0x04
+
+
+def crc8(data):
+    crc = 0xFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def read_chunk(stream):
+    # a serial port read waits for the whole count, take what has arrived
+    waiting = getattr(stream, 'in_waiting', None)
+    if waiting is None:
+        return stream.read(256)
+    return stream.read(waiting or 1)
+
+
+def frames(stream):
+    buf = bytearray()
+    while True:
+        chunk = read_chunk(stream)
+        if not chunk:
+            return
+        buf.extend(chunk)
+        while len(buf) >= FRAME_LEN:
+            if buf[0] != SYNC or crc8(buf[1:FRAME_LEN - 1]) != buf[FRAME_LEN - 1]:
+                del buf[0]
+                continue
+            yield struct.unpack('<BHHHB', bytes(buf[1:FRAME_LEN - 1]))
+            del buf[:FRAME_LEN]
+
+
+def range_name(flags):
+    # settling current is an upper bound, reference is moving
+    if flags & FLAG_SETTLING:
+        return 'settling'
+    return '5V' if flags & FLAG_RANGE_VCC else '1.1V'
+
+
+def open_input(args):
+    if args[0].startswith('/dev/'):
+        import serial
+        baud = int(args[1]) if len(args) > 1 else 500000
+        return serial.Serial(args[0], baud)
+    return open(args[0], 'rb')
+
+
+def main(args):
+    if not args:
+        print('usage: telemetry_decode.py <port|file> [baud]')
+        return 1
+
+    print('seq,time_ms,setpoint_v,current_ma,over_limit,range,lost')
+    prev_seq = None
+    lost = 0
+    for seq, time_ms, setpoint, current, flags in frames(open_input(args)):
+        if prev_seq is not None:
+            lost += (seq - prev_seq - 1) & 0xFF
+        prev_seq = seq
+        print('%d,%d,%.2f,%.3f,%d,%s,%d' % (
+            seq, time_ms, setpoint / 100.0, current / float(1 << FRAC_BITS),
+            1 if flags & FLAG_OVER_LIMIT else 0,
+            range_name(flags), lost))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,303 @@
+/*
+ * trace.c
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#include "trace.h"
+#include "peripherals.h"
+#include "eventqueue.h"
+#include <inttypes.h>
+
+#ifdef TRACE
+
+/* Compression
+ *
+ * Each block starts with an absolute sample (2 bytes, little endian) so
+ * blocks can be dropped from the ring independently. Following samples are
+ * stored as differences to the previous sample:
+ *
+ *   1rrrrrrr            r + 1 samples equal to the previous one
+ *   01aaabbb            two differences of -4 .. 3
+ *   000zzzzz            difference of -16 .. 15
+ *   001zzzzz zzzzzzzz   larger difference, 13 bits
+ *
+ * where z is the zigzag coded difference (0, -1, 1, -2, ... => 0, 1, 2, 3).
+ * A small difference is written as a single code and turned into a pair
+ * when the next one is small too. Steady current costs one byte per 128
+ * samples and ADC noise of an LSB or two half a byte per sample, compared
+ * with two bytes of raw storage. Larger differences start a new block.
+ */
+#define CODE_RUN 0x80
+#define CODE_PAIR 0x40
+#define CODE_LONG 0x20
+#define RUN_MAX 0x7F
+#define PAIR_BITS 3
+#define PAIR_MASK ((1 << PAIR_BITS) - 1)
+#define LONG_MAX 0x1FFF
+
+uint8_t trace_buf_[TRACE_BLOCKS][TRACE_BLOCK_SIZE];
+uint8_t trace_len_[TRACE_BLOCKS];
+uint8_t trace_head_ = 0;   // block being written
+uint8_t trace_blocks_ = 0; // blocks holding data
+uint8_t trace_run_ = 0;    // position of run code at end of head block, 0 if none
+uint8_t trace_pair_ = 0;   // position of single code that can take a pair
+uint16_t trace_prev_;
+uint8_t trace_decim_ = 0;
+uint8_t trace_state_ = TRACE_ARMED;
+uint16_t trace_post_ = 0;
+uint8_t trace_post_blocks_ = 0; // blocks started after trigger
+
+void trace_arm(void) {
+    trace_head_ = 0;
+    trace_blocks_ = 0;
+    trace_run_ = 0;
+    trace_pair_ = 0;
+    trace_decim_ = 0;
+    trace_post_ = 0;
+    trace_post_blocks_ = 0;
+    trace_state_ = TRACE_ARMED;
+}
+
+void trace_stop(void) {
+    trace_state_ = TRACE_STOPPED;
+}
+
+uint8_t trace_get_state(void) {
+    return trace_state_;
+}
+
+uint16_t trace_post_samples(void) {
+    return trace_post_;
+}
+
+/* Starts a new block with an absolute sample, oldest block is dropped when
+ * the ring is full. After trigger recording stops instead once
+ * TRACE_POST_BLOCKS blocks are used.
+ */
+void new_block(uint16_t current) {
+    if(trace_state_ == TRACE_TRIGGERED) {
+        if(trace_post_blocks_ == TRACE_POST_BLOCKS) {
+            trace_state_ = TRACE_STOPPED;
+            return;
+        }
+        trace_post_blocks_++;
+    }
+
+    if(trace_blocks_ > 0) {
+        trace_head_ = (trace_head_ + 1) % TRACE_BLOCKS;
+    }
+    if(trace_blocks_ < TRACE_BLOCKS) {
+        trace_blocks_++;
+    }
+
+    trace_buf_[trace_head_][0] = current & 0x00FF;
+    trace_buf_[trace_head_][1] = current >> 8;
+    trace_len_[trace_head_] = 2;
+    trace_run_ = 0;
+    trace_pair_ = 0;
+}
+
+void record(uint16_t current) {
+    uint8_t *block = trace_buf_[trace_head_];
+    uint8_t len = trace_len_[trace_head_];
+
+    if(trace_blocks_ == 0) {
+        new_block(current);
+        return;
+    }
+
+    int16_t delta = current - trace_prev_;
+    uint16_t zigzag = delta < 0 ? ((uint16_t)(-delta) << 1) - 1 : (uint16_t)delta << 1;
+    if(trace_pair_ && zigzag <= PAIR_MASK) {
+        block[trace_pair_] = CODE_PAIR | block[trace_pair_] << PAIR_BITS | zigzag;
+        trace_pair_ = 0;
+        return;
+    }
+
+    if(delta == 0) {
+        if(trace_run_ && block[trace_run_] != (CODE_RUN | RUN_MAX)) {
+            block[trace_run_]++;
+        } else if(len < TRACE_BLOCK_SIZE) {
+            trace_run_ = len;
+            block[trace_len_[trace_head_]++] = CODE_RUN;
+        } else {
+            new_block(current);
+        }
+        return;
+    }
+
+    trace_run_ = 0;
+    trace_pair_ = 0;
+    if(zigzag < CODE_LONG && len < TRACE_BLOCK_SIZE) {
+        block[len] = zigzag;
+        trace_len_[trace_head_] = len + 1;
+        if(zigzag <= PAIR_MASK) {
+            trace_pair_ = len;
+        }
+    } else if(zigzag >= CODE_LONG && zigzag <= LONG_MAX &&
+              len + 1 < TRACE_BLOCK_SIZE) {
+        block[len] = CODE_LONG | (zigzag >> 8);
+        block[len + 1] = zigzag & 0x00FF;
+        trace_len_[trace_head_] = len + 2;
+    } else {
+        new_block(current);
+    }
+}
+
+void trace_sample(uint16_t current) {
+    if(trace_state_ == TRACE_STOPPED || ++trace_decim_ < TRACE_DECIMATION) {
+        return;
+    }
+    trace_decim_ = 0;
+
+    uint16_t limit = *get_current_limit();
+    if(trace_state_ == TRACE_ARMED && trace_blocks_ > 0 &&
+       trace_prev_ <= limit && current > limit) {
+        trace_state_ = TRACE_TRIGGERED;
+        new_block(current);
+    } else {
+        record(current);
+    }
+    trace_prev_ = current;
+
+    if(trace_state_ == TRACE_TRIGGERED) {
+        trace_post_++;
+    }
+}
+
+/* Dump ---------------------------------------------------------------------- */
+
+#define DUMP_SAMPLES_PER_EVENT 8
+
+uint8_t dump_block_;  // blocks left
+uint8_t dump_idx_;    // block being dumped
+uint8_t dump_pos_;
+uint8_t dump_run_;    // repeats left of current run code
+uint8_t dump_pair_;   // second difference of pair code + 1, 0 if none
+uint16_t dump_value_;
+uint8_t dump_first_;
+
+uint16_t unzigzag(uint16_t value, uint16_t zigzag) {
+    if(zigzag & 1) {
+        return value - ((zigzag + 1) >> 1);
+    }
+    return value + (zigzag >> 1);
+}
+
+/* Decodes next sample, returns 0 when the buffer is exhausted */
+uint8_t dump_next(uint16_t* value) {
+    while(dump_block_ > 0) {
+        uint8_t *block = trace_buf_[dump_idx_];
+
+        if(dump_run_ > 0) {
+            dump_run_--;
+            *value = dump_value_;
+            return 1;
+        }
+
+        if(dump_pair_ > 0) {
+            dump_value_ = unzigzag(dump_value_, dump_pair_ - 1);
+            dump_pair_ = 0;
+            *value = dump_value_;
+            return 1;
+        }
+
+        if(dump_pos_ == 0) {
+            dump_value_ = block[0] | ((uint16_t)block[1] << 8);
+            dump_pos_ = 2;
+            *value = dump_value_;
+            return 1;
+        }
+
+        if(dump_pos_ < trace_len_[dump_idx_]) {
+            uint8_t code = block[dump_pos_++];
+            if(code & CODE_RUN) {
+                dump_run_ = (code & RUN_MAX) + 1;
+                continue;
+            }
+
+            uint16_t zigzag = code;
+            if(code & CODE_PAIR) {
+                zigzag = (code >> PAIR_BITS) & PAIR_MASK;
+                dump_pair_ = (code & PAIR_MASK) + 1;
+            } else if(code & CODE_LONG) {
+                zigzag = ((uint16_t)(code & ~CODE_LONG) << 8) | block[dump_pos_++];
+            }
+            dump_value_ = unzigzag(dump_value_, zigzag);
+            *value = dump_value_;
+            return 1;
+        }
+
+        // next block
+        dump_block_--;
+        dump_idx_ = (dump_idx_ + 1) % TRACE_BLOCKS;
+        dump_pos_ = 0;
+    }
+    return 0;
+}
+
+void dump_handler(uint16_t null) {
+    char buf[DUMP_SAMPLES_PER_EVENT * 6 + 1];
+    uint8_t len = 0;
+
+    // save decoder state in case UART has no room for this chunk
+    uint8_t block = dump_block_, idx = dump_idx_, pos = dump_pos_, run = dump_run_;
+    uint8_t pair = dump_pair_;
+    uint16_t value = dump_value_;
+    uint8_t first = dump_first_;
+
+    uint16_t sample;
+    uint8_t more = 1;
+    for(uint8_t count = 0; count < DUMP_SAMPLES_PER_EVENT; count++) {
+        if(!(more = dump_next(&sample))) {
+            break;
+        }
+        if(!dump_first_) {
+            buf[len++] = ',';
+        }
+        dump_first_ = 0;
+
+        char digits[5];
+        uint8_t ndigits = 0;
+        do {
+            digits[ndigits++] = '0' + sample % 10;
+            sample /= 10;
+        } while(sample);
+        while(ndigits) {
+            buf[len++] = digits[--ndigits];
+        }
+    }
+    if(!more) {
+        buf[len++] = '\n';
+    }
+
+    if(!uart_write((const uint8_t*)buf, len)) {
+        dump_block_ = block;
+        dump_idx_ = idx;
+        dump_pos_ = pos;
+        dump_run_ = run;
+        dump_pair_ = pair;
+        dump_value_ = value;
+        dump_first_ = first;
+        evq_timed_push(dump_handler, 0, 2, EVQ_BACKGROUND);
+    } else if(more) {
+        evq_push(dump_handler, 0, EVQ_BACKGROUND);
+    }
+}
+
+void trace_dump(void) {
+    trace_stop();
+
+    dump_block_ = trace_blocks_;
+    dump_idx_ = (trace_head_ + TRACE_BLOCKS + 1 - trace_blocks_) % TRACE_BLOCKS;
+    dump_pos_ = 0;
+    dump_run_ = 0;
+    dump_pair_ = 0;
+    dump_first_ = 1;
+    evq_push(dump_handler, 0, EVQ_BACKGROUND);
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * trace.h
+ *
+ * Author: Tuomas Vaherkoski <tuomasvaherkoski@gmail.com>
+ *
+ * This file is part of variable-power-supply project.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <inttypes.h>
+
+/* Rolling current trace recorder, built when TRACE is defined. Requires
+ * UART_BAUD for the dump.
+ *
+ * Every TRACE_DECIMATION'th current sample is stored delta compressed into
+ * a ring of TRACE_BLOCKS blocks. Recording runs until current crosses the
+ * current limit upwards. The crossing sample starts a new block and
+ * recording stops when TRACE_POST_BLOCKS blocks are full after the
+ * trigger, so the rest of the ring keeps the history before it.
+ */
+#ifndef TRACE_DECIMATION
+#define TRACE_DECIMATION 8
+#endif
+#define TRACE_BLOCKS 8
+#define TRACE_BLOCK_SIZE 32
+#ifndef TRACE_POST_BLOCKS
+#define TRACE_POST_BLOCKS (TRACE_BLOCKS / 2)
+#endif
+
+#if TRACE_POST_BLOCKS < 1 || TRACE_POST_BLOCKS >= TRACE_BLOCKS
+#error "TRACE_POST_BLOCKS must leave room for history before the trigger"
+#endif
+
+#if defined(TRACE) && !defined(UART_BAUD)
+#error "TRACE requires UART_BAUD"
+#endif
+
+typedef enum {
+    TRACE_ARMED,     // recording, waiting for trigger
+    TRACE_TRIGGERED, // recording post-trigger samples
+    TRACE_STOPPED    // buffer frozen
+} trace_state;
+
+#ifdef TRACE
+/* Feeds a current sample in mA */
+void trace_sample(uint16_t current);
+
+/* Clears the buffer and starts recording */
+void trace_arm(void);
+
+/* Stops recording */
+void trace_stop(void);
+
+uint8_t trace_get_state(void);
+
+/* Number of samples recorded after the trigger */
+uint16_t trace_post_samples(void);
+
+/* Stops recording and writes the buffer to UART as one line of comma
+ * separated mA values, oldest first. Output is paced through the event
+ * queue so it never waits for the UART.
+ */
+void trace_dump(void);
+#endif
+
+#endif /* TRACE_H_ */